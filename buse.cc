@@ -21,16 +21,35 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/types.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "trace.h"
+#include "uring.h"
+
+#ifdef BUSE_IO_URING
+#if __has_include(<linux/ublk_cmd.h>) && defined(IORING_SETUP_SQE128)
+#include <linux/ublk_cmd.h>
+#define BUSE_UBLK
+#endif
+#endif
 
 /*
  * These helper functions were taken from cliserv.h in the nbd distribution.
@@ -50,46 +69,1018 @@ u_int64_t ntohll(u_int64_t a) {
 #endif
 #define htonll ntohll
 
+/* Both return -1 if the peer went away, which a network client may do at
+ * any time. */
 static int read_all(int fd, char* buf, size_t count)
 {
-  int bytes_read;
+  ssize_t bytes_read;
 
   while (count > 0) {
     bytes_read = read(fd, buf, count);
-    assert(bytes_read > 0);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
     buf += bytes_read;
     count -= bytes_read;
   }
-  assert(count == 0);
 
   return 0;
 }
 
 static int write_all(int fd, char* buf, size_t count)
 {
-  int bytes_written;
+  ssize_t bytes_written;
 
   while (count > 0) {
     bytes_written = write(fd, buf, count);
-    assert(bytes_written > 0);
+    if (bytes_written < 0 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+      return -1;
     buf += bytes_written;
     count -= bytes_written;
   }
-  assert(count == 0);
 
   return 0;
 }
 
-int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
+/*
+ * Sends count bytes of fd starting at offset without copying them through
+ * user space. Whatever the file can't provide is sent as zeros, the reply
+ * header is out already.
+ */
+static int sendfile_all(int sk, int fd, off_t offset, size_t count)
+{
+  static char zeros[4096];
+  ssize_t bytes_sent;
+
+  while (count > 0) {
+    bytes_sent = sendfile(sk, fd, &offset, count);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent <= 0)
+      break;
+    count -= bytes_sent;
+  }
+  while (count > 0) {
+    bytes_sent = count < sizeof(zeros) ? count : sizeof(zeros);
+    if (write_all(sk, zeros, bytes_sent) < 0)
+      return -1;
+    count -= bytes_sent;
+  }
+
+  return 0;
+}
+
+/*
+ * Request buffers come from a per-connection pool of page aligned buffers
+ * in power of two size classes, so a busy device doesn't go through malloc
+ * and mmap/munmap with every request. A few buffers per class are kept for
+ * reuse; classes of 2M and up may be backed by huge pages.
+ */
+#define POOL_MIN_SHIFT  12
+#define POOL_CLASSES    20
+#define POOL_DEPTH      8
+#define POOL_MAX_CACHED (64 * 1024 * 1024)
+#define POOL_HUGE_SHIFT 21
+
+int buse_use_hugepages = 0;
+
+struct buffer_pool {
+  pthread_mutex_t lock;
+  void *free_list[POOL_CLASSES][POOL_DEPTH];
+  int free_count[POOL_CLASSES];
+  size_t allocated;
+  struct buse_pool_stats stats;
+  struct buffer_pool *next;  /* on live_pools */
+};
+
+/* Every connection has its own pool. The counters of pools already
+ * destroyed are kept in retired_stats so the totals don't go backwards. */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer_pool *live_pools;
+static struct buse_pool_stats retired_stats;
+
+static int pool_class(size_t len)
+{
+  int cls = 0;
+
+  while (((size_t)1 << (cls + POOL_MIN_SHIFT)) < len)
+    cls++;
+  return cls;
+}
+
+static void pool_init(struct buffer_pool *pool)
+{
+  memset(pool, 0, sizeof(*pool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_mutex_lock(&pools_lock);
+  pool->next = live_pools;
+  live_pools = pool;
+  pthread_mutex_unlock(&pools_lock);
+}
+
+/* Adds the counters of one pool to *sum. */
+static void pool_stats_add(struct buse_pool_stats *sum, const struct buse_pool_stats *stats)
+{
+  sum->gets += stats->gets;
+  sum->hits += stats->hits;
+  sum->allocs += stats->allocs;
+  sum->huge_allocs += stats->huge_allocs;
+  sum->cached_bytes += stats->cached_bytes;
+  if (stats->peak_bytes > sum->peak_bytes)
+    sum->peak_bytes = stats->peak_bytes;
+}
+
+static void pool_unmap(void *buf, int cls)
+{
+  munmap(buf, (size_t)1 << (cls + POOL_MIN_SHIFT));
+}
+
+static void pool_destroy(struct buffer_pool *pool)
+{
+  struct buffer_pool **link;
+  int cls;
+
+  for (cls = 0; cls < POOL_CLASSES; cls++) {
+    while (pool->free_count[cls] > 0)
+      pool_unmap(pool->free_list[cls][--pool->free_count[cls]], cls);
+  }
+  pool->stats.cached_bytes = 0;
+  pthread_mutex_lock(&pools_lock);
+  for (link = &live_pools; *link != NULL; link = &(*link)->next) {
+    if (*link == pool) {
+      *link = pool->next;
+      break;
+    }
+  }
+  pool_stats_add(&retired_stats, &pool->stats);
+  pthread_mutex_unlock(&pools_lock);
+  buse_log(BUSE_LOG_INFO, "buffer pool: %llu requests, %llu reused, %llu allocated "
+          "(%llu huge), peak %llu bytes\n",
+          (unsigned long long)pool->stats.gets, (unsigned long long)pool->stats.hits,
+          (unsigned long long)pool->stats.allocs, (unsigned long long)pool->stats.huge_allocs,
+          (unsigned long long)pool->stats.peak_bytes);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+static void *pool_get(struct buffer_pool *pool, size_t len)
+{
+  int cls = pool_class(len);
+  size_t size = (size_t)1 << (cls + POOL_MIN_SHIFT);
+  void *buf = MAP_FAILED;
+  int huge = 0;
+
+  if (cls >= POOL_CLASSES)
+    return NULL;
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.gets++;
+  if (pool->free_count[cls] > 0) {
+    buf = pool->free_list[cls][--pool->free_count[cls]];
+    pool->stats.hits++;
+    pool->stats.cached_bytes -= size;
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+#ifdef MAP_HUGETLB
+  if (buse_use_hugepages && (cls + POOL_MIN_SHIFT >= POOL_HUGE_SHIFT)) {
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (buf == MAP_FAILED) {
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+      return NULL;
+  } else {
+    huge = 1;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.allocs++;
+  pool->stats.huge_allocs += huge;
+  pool->allocated += size;
+  if (pool->allocated > pool->stats.peak_bytes)
+    pool->stats.peak_bytes = pool->allocated;
+  pthread_mutex_unlock(&pool->lock);
+  return buf;
+}
+
+static void pool_put(struct buffer_pool *pool, void *buf, size_t len)
+{
+  int cls = pool_class(len);
+  size_t size = (size_t)1 << (cls + POOL_MIN_SHIFT);
+
+  if (buf == NULL)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  if ((pool->free_count[cls] < POOL_DEPTH) &&
+      (pool->stats.cached_bytes + size <= POOL_MAX_CACHED)) {
+    pool->free_list[cls][pool->free_count[cls]++] = buf;
+    pool->stats.cached_bytes += size;
+    buf = NULL;
+  } else {
+    pool->allocated -= size;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (buf != NULL)
+    pool_unmap(buf, cls);
+}
+
+void buse_get_pool_stats(struct buse_pool_stats *stats)
+{
+  struct buffer_pool *pool;
+
+  pthread_mutex_lock(&pools_lock);
+  memcpy(stats, &retired_stats, sizeof(*stats));
+  for (pool = live_pools; pool != NULL; pool = pool->next) {
+    pthread_mutex_lock(&pool->lock);
+    pool_stats_add(stats, &pool->stats);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+/* What a network client negotiated; all zero for the kernel. */
+struct nbd_session {
+  int structured;       /* NBD_OPT_STRUCTURED_REPLY */
+  int base_allocation;  /* the base:allocation metadata context */
+};
+
+#ifndef NBD_STRUCTURED_REPLY_MAGIC
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#endif
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) | 1)
+#define NBD_CHUNK_HEADER            20
+#define BUSE_CONTEXT_ALLOCATION     1
+
+#define BUSE_READ_CHUNKS    64   /* holes and data runs in one read reply */
+#define BUSE_STATUS_EXTENTS 512  /* extents in one block status reply */
+
+#define REPLY_SIMPLE      0  /* the reply, followed by chunk if any */
+#define REPLY_STRUCTURED  1  /* chunk holds the whole reply */
+#define REPLY_DISC        2
+
+#define BUSE_BLOCK_SIZE  512
+#define BUSE_MAX_REQUEST (32 * 1024 * 1024)  /* what the nbd driver sends at most */
+
+static u_int32_t block_size(const struct buse_operations *aop)
+{
+  return aop->block_size ? aop->block_size : BUSE_BLOCK_SIZE;
+}
+
+/* Data commands must be sector aligned, not empty and inside the export;
+ * the kernel always complies, network clients need not. */
+static int check_request(const struct buse_operations *aop, u_int32_t type,
+                         u_int64_t from, u_int32_t len)
+{
+  int writing = (type == NBD_CMD_WRITE) || (type == BUSE_CMD_WRITE_ZEROES);
+
+  switch (type) {
+  case NBD_CMD_READ:
+  case NBD_CMD_WRITE:
+    if (len > BUSE_MAX_REQUEST)
+      return EINVAL;
+    /* fall through */
+  case NBD_CMD_TRIM:
+  case BUSE_CMD_WRITE_ZEROES:
+    if (len == 0)
+      return EINVAL;
+    /* fall through */
+  case BUSE_CMD_CACHE:
+  case BUSE_CMD_BLOCK_STATUS:
+    if ((from | len) & (block_size(aop) - 1))
+      return EINVAL;
+    if ((from > aop->size) || (len > aop->size - from))
+      return writing ? ENOSPC : EINVAL;
+  }
+  return 0;
+}
+
+static char *put_chunk_header(char *p, const char *handle, u_int16_t flags,
+                              u_int16_t type, u_int32_t length)
+{
+  u_int32_t magic = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+
+  flags = htons(flags);
+  type = htons(type);
+  length = htonl(length);
+  memcpy(p, &magic, 4);
+  memcpy(p + 4, &flags, 2);
+  memcpy(p + 6, &type, 2);
+  memcpy(p + 8, handle, 8);
+  memcpy(p + 16, &length, 4);
+  return p + NBD_CHUNK_HEADER;
+}
+
+/* the header of data sent straight from a file: the simple reply, or a
+ * single OFFSET_DATA chunk */
+static size_t data_header(const struct nbd_session *session, const struct nbd_reply *reply,
+                          u_int64_t from, u_int32_t len, char *head)
+{
+  if (!session->structured) {
+    memcpy(head, reply, sizeof(*reply));
+    return sizeof(*reply);
+  }
+  put_chunk_header(head, reply->handle, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA, 8 + len);
+  from = htonll(from);
+  memcpy(head + NBD_CHUNK_HEADER, &from, 8);
+  return NBD_CHUNK_HEADER + 8;
+}
+
+static int structured_error(struct buffer_pool *pool, const struct nbd_reply *reply, u_int32_t err,
+                            void **chunk, u_int32_t *chunk_len)
+{
+  char *p = (char*)pool_get(pool, NBD_CHUNK_HEADER + 6);
+
+  *chunk = p;
+  if (p == NULL)
+    return REPLY_DISC;  /* can't even say so */
+  *chunk_len = NBD_CHUNK_HEADER + 6;
+  p = put_chunk_header(p, reply->handle, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, 6);
+  err = htonl(err);
+  memcpy(p, &err, 4);
+  memset(p + 4, 0, 2);  /* no message */
+  return REPLY_STRUCTURED;
+}
+
+/* Trims extents to the len bytes asked for; returns how many are left. */
+static int clip_extents(struct buse_extent *extents, int n, u_int32_t len)
+{
+  int i, used = 0;
+
+  for (i = 0; i < n && len > 0; i++) {
+    if (extents[i].length == 0)
+      continue;
+    if (extents[i].length > len)
+      extents[i].length = len;
+    len -= extents[i].length;
+    extents[used++] = extents[i];
+  }
+  return used;
+}
+
+/*
+ * Structured reply to a read: ranges that read as zeros go out as
+ * OFFSET_HOLE chunks without payload, the data is read straight into place
+ * behind its OFFSET_DATA header. Everything ends up in one buffer.
+ */
+static int structured_read(const struct buse_operations *aop, void *userdata,
+                           struct buffer_pool *pool, u_int32_t flags, u_int64_t from,
+                           u_int32_t len, const struct nbd_reply *reply,
+                           void **chunk, u_int32_t *chunk_len)
+{
+  struct buse_extent extents[BUSE_READ_CHUNKS + 1];
+  u_int32_t total = 0, done = 0, covered = 0, word;
+  u_int64_t offset;
+  char *buf, *p, *last = NULL;
+  int n = 0, i, err = 0;
+
+  if (aop->block_status && !(flags & BUSE_CMD_FLAG_DF))
+    n = clip_extents(extents, aop->block_status(from, len, extents, BUSE_READ_CHUNKS, userdata), len);
+  for (i = 0; i < n; i++)
+    covered += extents[i].length;
+  if (covered < len) {
+    extents[n].length = len - covered;
+    extents[n++].flags = 0;
+  }
+  for (i = 0; i < n; i++)
+    total += NBD_CHUNK_HEADER + 8 + ((extents[i].flags & NBD_STATE_ZERO) ? 4 : extents[i].length);
+
+  buf = (char*)pool_get(pool, total);
+  if (buf == NULL)
+    return structured_error(pool, reply, ENOMEM, chunk, chunk_len);
+  for (i = 0, p = buf; i < n; i++) {
+    last = p;
+    offset = htonll(from + done);
+    if (extents[i].flags & NBD_STATE_ZERO) {
+      p = put_chunk_header(p, reply->handle, 0, NBD_REPLY_TYPE_OFFSET_HOLE, 12);
+      memcpy(p, &offset, 8);
+      word = htonl(extents[i].length);
+      memcpy(p + 8, &word, 4);
+      p += 12;
+    } else {
+      p = put_chunk_header(p, reply->handle, 0, NBD_REPLY_TYPE_OFFSET_DATA, 8 + extents[i].length);
+      memcpy(p, &offset, 8);
+      p += 8;
+      if (aop->read)
+        err = aop->read(p, extents[i].length, from + done, userdata);
+      else
+        err = EPERM;
+      if (err)
+        break;
+      p += extents[i].length;
+    }
+    done += extents[i].length;
+  }
+  if (err) {
+    pool_put(pool, buf, total);
+    return structured_error(pool, reply, (err == EPERM) ? EPERM : EIO, chunk, chunk_len);
+  }
+  word = htons(NBD_REPLY_FLAG_DONE);
+  memcpy(last + 4, &word, 2);
+  *chunk = buf;
+  *chunk_len = total;
+  return REPLY_STRUCTURED;
+}
+
+static int structured_block_status(const struct buse_operations *aop, void *userdata,
+                                   struct buffer_pool *pool, u_int32_t flags, u_int64_t from,
+                                   u_int32_t len, const struct nbd_reply *reply,
+                                   void **chunk, u_int32_t *chunk_len)
+{
+  struct buse_extent extents[BUSE_STATUS_EXTENTS];
+  u_int32_t word;
+  char *buf, *p;
+  int n, i;
+
+  n = aop->block_status(from, len, extents,
+                        (flags & BUSE_CMD_FLAG_REQ_ONE) ? 1 : BUSE_STATUS_EXTENTS, userdata);
+  n = clip_extents(extents, n, len);
+  if (n <= 0)
+    return structured_error(pool, reply, EIO, chunk, chunk_len);
+
+  *chunk_len = NBD_CHUNK_HEADER + 4 + 8 * n;
+  buf = (char*)pool_get(pool, *chunk_len);
+  if (buf == NULL)
+    return structured_error(pool, reply, ENOMEM, chunk, chunk_len);
+  p = put_chunk_header(buf, reply->handle, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+                       4 + 8 * n);
+  word = htonl(BUSE_CONTEXT_ALLOCATION);
+  memcpy(p, &word, 4);
+  p += 4;
+  for (i = 0; i < n; i++, p += 8) {
+    word = htonl(extents[i].length);
+    memcpy(p, &word, 4);
+    word = htonl(extents[i].flags);
+    memcpy(p + 4, &word, 4);
+  }
+  *chunk = buf;
+  return REPLY_STRUCTURED;
+}
+
+/* Callbacks return nonzero on failure, which need not be an errno a
+ * client knows; the reply says EIO like the ublk path does. */
+static u_int32_t op_error(int ret)
+{
+  return ret ? htonl(EIO) : 0;
+}
+
+/*
+ * Runs one request against the callbacks; payload holds the data of a write.
+ * Returns REPLY_DISC for a disconnect. Otherwise *chunk (*chunk_len bytes,
+ * from the pool, the caller returns it) is either the data to send after
+ * the simple reply, or with REPLY_STRUCTURED the whole reply.
+ */
+static int handle_request(const struct buse_operations *aop, void *userdata,
+                          const struct nbd_session *session, struct buffer_pool *pool,
+                          u_int32_t type, u_int32_t flags, u_int64_t from, u_int32_t len,
+                          void *payload, struct nbd_reply *reply,
+                          void **chunk, u_int32_t *chunk_len)
+{
+  int fua = (flags & NBD_CMD_FLAG_FUA) != 0;
+  int structured = session->structured &&
+                   (type == NBD_CMD_READ || type == BUSE_CMD_BLOCK_STATUS);
+  int err;
+
+  *chunk = NULL;
+  *chunk_len = 0;
+  reply->error = htonl(0);
+  if ((err = check_request(aop, type, from, len)) != 0) {
+    if (structured)
+      return structured_error(pool, reply, err, chunk, chunk_len);
+    reply->error = htonl(err);
+    return REPLY_SIMPLE;
+  }
+
+  switch(type) {
+    /* I may at some point need to deal with the the fact that the
+     * official nbd server has a maximum buffer size, and divides up
+     * oversized requests into multiple pieces. This applies to reads
+     * and writes.
+     */
+  case NBD_CMD_READ:
+    if (structured)
+      return structured_read(aop, userdata, pool, flags, from, len, reply, chunk, chunk_len);
+    *chunk = pool_get(pool, len);
+    *chunk_len = len;
+    if (*chunk == NULL) {
+      reply->error = htonl(ENOMEM);
+    } else if (aop->read) {
+      reply->error = op_error(aop->read(*chunk, len, from, userdata));
+    } else {
+      /* If user not specified read operation, return EPERM error */
+      reply->error = htonl(EPERM);
+    }
+    if (reply->error != 0) {
+      /* an error reply carries no data */
+      pool_put(pool, *chunk, len);
+      *chunk = NULL;
+      *chunk_len = 0;
+    }
+    break;
+  case NBD_CMD_WRITE:
+    buse_trace(TRACE_NBD_WRITE, from, len);
+    if (payload == NULL) {
+      reply->error = htonl(ENOMEM);
+    } else if (fua && aop->write_fua) {
+      reply->error = op_error(aop->write_fua(payload, len, from, userdata));
+    } else if (aop->write) {
+      reply->error = op_error(aop->write(payload, len, from, userdata));
+      if (fua && !reply->error && aop->flush)
+        reply->error = op_error(aop->flush(userdata));
+    } else {
+      /* If user not specified write operation, return EPERM error */
+      reply->error = htonl(EPERM);
+    }
+    break;
+  case NBD_CMD_DISC:
+    /* Handle a disconnect request. */
+    if (aop->disc) {
+      aop->disc(userdata);
+    }
+    return REPLY_DISC;
+#ifdef NBD_FLAG_SEND_FLUSH
+  case NBD_CMD_FLUSH:
+    buse_trace(TRACE_NBD_FLUSH, 0, 0);
+    if (aop->flush) {
+      reply->error = op_error(aop->flush(userdata));
+    }
+    break;
+#endif
+#ifdef NBD_FLAG_SEND_TRIM
+  case NBD_CMD_TRIM:
+    buse_trace(TRACE_NBD_TRIM, from, len);
+    if (aop->trim) {
+      reply->error = op_error(aop->trim(from, len, userdata));
+    }
+    break;
+#endif
+  case BUSE_CMD_WRITE_ZEROES:
+    buse_trace(TRACE_NBD_WRITE_ZEROES, from, len);
+    if (aop->write_zeroes) {
+      reply->error = op_error(aop->write_zeroes(from, len, fua, userdata));
+    } else {
+      reply->error = htonl(EINVAL);
+    }
+    break;
+  case BUSE_CMD_CACHE:
+    buse_trace(TRACE_NBD_CACHE, from, len);
+    if (aop->cache) {
+      reply->error = op_error(aop->cache(from, len, userdata));
+    }
+    break;
+  case BUSE_CMD_BLOCK_STATUS:
+    buse_trace(TRACE_NBD_BLOCK_STATUS, from, len);
+    if (structured && session->base_allocation && aop->block_status)
+      return structured_block_status(aop, userdata, pool, flags, from, len, reply, chunk, chunk_len);
+    if (structured)
+      return structured_error(pool, reply, EINVAL, chunk, chunk_len);
+    reply->error = htonl(EINVAL);
+    break;
+  default:
+    reply->error = htonl(EINVAL);
+  }
+  return REPLY_SIMPLE;
+}
+
+/*
+ * Replies are collected in a batch and sent with one writev()/sendmsg(),
+ * header and data of every reply gathered.
+ */
+#define BATCH_REPLIES   128
+
+struct reply_batch {
+  struct nbd_reply replies[BATCH_REPLIES];
+  void *chunks[BATCH_REPLIES];
+  size_t chunk_sizes[BATCH_REPLIES];
+  struct iovec iov[2 * BATCH_REPLIES];
+  int count, iovcnt;
+  size_t bytes;
+  struct msghdr msg;
+};
+
+/* reply is NULL when chunk is a structured reply */
+static void batch_add(struct reply_batch *batch, const struct nbd_reply *reply,
+                      void *chunk, u_int32_t len)
+{
+  struct nbd_reply *copy = &batch->replies[batch->count];
+
+  if (reply) {
+    memcpy(copy, reply, sizeof(*copy));
+    batch->iov[batch->iovcnt].iov_base = copy;
+    batch->iov[batch->iovcnt++].iov_len = sizeof(*copy);
+    batch->bytes += sizeof(*copy);
+  }
+  if (chunk) {
+    batch->iov[batch->iovcnt].iov_base = chunk;
+    batch->iov[batch->iovcnt++].iov_len = len;
+    batch->bytes += len;
+  }
+  batch->chunk_sizes[batch->count] = len;
+  batch->chunks[batch->count++] = chunk;
+}
+
+/* writes whatever the ring did not send of a batch, then empties it */
+static void batch_finish(int sk, struct buffer_pool *pool, struct reply_batch *batch, size_t sent)
+{
+  int i;
+
+  for (i = 0; i < batch->iovcnt; i++) {
+    if (sent >= batch->iov[i].iov_len) {
+      sent -= batch->iov[i].iov_len;
+      continue;
+    }
+    write_all(sk, (char*)batch->iov[i].iov_base + sent, batch->iov[i].iov_len - sent);
+    sent = 0;
+  }
+  for (i = 0; i < batch->count; i++)
+    pool_put(pool, batch->chunks[i], batch->chunk_sizes[i]);
+  batch->count = 0;
+  batch->iovcnt = 0;
+  batch->bytes = 0;
+}
+
+static void batch_send(int sk, struct buffer_pool *pool, struct reply_batch *batch)
+{
+  ssize_t sent;
+
+  if (batch->iovcnt == 0)
+    return;
+  sent = writev(sk, batch->iov, batch->iovcnt);
+  batch_finish(sk, pool, batch, (sent > 0) ? sent : 0);
+}
+
+/* drops the payload of a write that couldn't get a buffer */
+static int skip_all(int fd, size_t count)
+{
+  char buf[4096];
+  size_t n;
+
+  while (count > 0) {
+    n = (count < sizeof(buf)) ? count : sizeof(buf);
+    if (read_all(fd, buf, n) < 0)
+      return -1;
+    count -= n;
+  }
+  return 0;
+}
+
+/*
+ * Blocking loop: every read() takes as many requests as the socket has queued
+ * and their replies go out together before the next read() can block.
+ */
+#define SERVE_RX_SIZE   (64 * 1024)
+
+static int serve(int sk, const struct buse_operations *aop, const struct nbd_session *session,
+                 void *userdata)
 {
-  int sp[2];
-  int nbd, sk, err, tmp_fd;
   u_int64_t from;
-  u_int32_t len;
+  u_int32_t len, type, flags, copied, chunk_len;
+  char head[NBD_CHUNK_HEADER + 8];
   ssize_t bytes_read;
+  size_t rx_start = 0, rx_end = 0;
+  int fd, ret;
+  u_int64_t fd_offset;
   struct nbd_request request;
   struct nbd_reply reply;
-  void *chunk;
+  struct buffer_pool pool;
+  struct reply_batch *batch;
+  char *rx;
+  void *chunk, *payload;
+
+  pool_init(&pool);
+  rx = (char*)malloc(SERVE_RX_SIZE);
+  batch = (struct reply_batch*)calloc(1, sizeof(struct reply_batch));
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  reply.error = htonl(0);
+
+  for (;;) {
+    if (rx_end - rx_start < sizeof(request)) {
+      /* about to block, send what is done first */
+      batch_send(sk, &pool, batch);
+      memmove(rx, rx + rx_start, rx_end - rx_start);
+      rx_end -= rx_start;
+      rx_start = 0;
+      bytes_read = read(sk, rx + rx_end, SERVE_RX_SIZE - rx_end);
+      if (bytes_read <= 0) {
+        if (bytes_read == -1)
+          fprintf(stderr, "%s\n", strerror(errno));
+        break;
+      }
+      rx_end += bytes_read;
+      continue;
+    }
+    memcpy(&request, rx + rx_start, sizeof(request));
+    rx_start += sizeof(request);
+    memcpy(reply.handle, request.handle, sizeof(reply.handle));
+    reply.error = htonl(0);
+
+    len = ntohl(request.len);
+    from = ntohll(request.from);
+    type = ntohl(request.type);
+    flags = type & ~BUSE_CMD_MASK;
+    type &= BUSE_CMD_MASK;
+    if (request.magic != htonl(NBD_REQUEST_MAGIC) ||
+        (type == NBD_CMD_WRITE && len > BUSE_MAX_REQUEST))
+      break;
+
+    payload = NULL;
+    if (type == NBD_CMD_READ) {
+      buse_trace(TRACE_NBD_READ, from, len);
+      if (aop->read_fd && check_request(aop, type, from, len) == 0 &&
+          aop->read_fd(&fd, &fd_offset, len, from, userdata) == 0) {
+        batch_send(sk, &pool, batch);
+        write_all(sk, head, data_header(session, &reply, from, len, head));
+        sendfile_all(sk, fd, (off_t)fd_offset, len);
+        close(fd);
+        continue;
+      }
+    } else if (type == NBD_CMD_WRITE) {
+      /* the start of the data may have come with the header */
+      copied = (rx_end - rx_start < len) ? (u_int32_t)(rx_end - rx_start) : len;
+      payload = pool_get(&pool, len);
+      if (payload != NULL)
+        memcpy(payload, rx + rx_start, copied);
+      rx_start += copied;
+      if (copied < len) {
+        batch_send(sk, &pool, batch);
+        if (payload != NULL) {
+          if (read_all(sk, (char*)payload + copied, len - copied) < 0) {
+            pool_put(&pool, payload, len);
+            break;
+          }
+        } else if (skip_all(sk, len - copied) < 0) {
+          /* ... or the request fails with ENOMEM, keeping the stream in sync */
+          break;
+        }
+      }
+    }
+    ret = handle_request(aop, userdata, session, &pool, type, flags, from, len, payload,
+                         &reply, &chunk, &chunk_len);
+    pool_put(&pool, payload, len);
+    if (ret == REPLY_DISC)
+      break;
+    batch_add(batch, (ret == REPLY_SIMPLE) ? &reply : NULL, chunk, chunk_len);
+    if (batch->count == BATCH_REPLIES)
+      batch_send(sk, &pool, batch);
+  }
+  batch_send(sk, &pool, batch);
+  free(batch);
+  free(rx);
+  pool_destroy(&pool);
+  return 0;
+}
+
+#ifdef BUSE_IO_URING
+/*
+ * io_uring based loop: one receive into a large buffer picks up every request
+ * the kernel queued, they are run against the callbacks and all their replies
+ * go out with a single sendmsg. Receive and send of the next batch are
+ * submitted with one io_uring_enter(), so a busy device costs a couple of
+ * syscalls per batch instead of several per request. Only used on kernels
+ * with IORING_FEAT_FAST_POLL (5.7), serve() is the fallback.
+ */
+#define URING_ENTRIES   8
+#define URING_RX_SIZE   (256 * 1024)
+#define URING_TAG_RECV  1
+#define URING_TAG_SEND  2
+#define URING_TAG_CANCEL 3
+
+struct uring_server {
+  struct uring ring;
+  int sk;
+  char *rx;
+  size_t rx_size, rx_start, rx_end, rx_need;
+  int recv_busy, send_busy, eof;
+  struct reply_batch *building, *sending;
+  struct buffer_pool pool;
+};
+
+static void uring_reap(struct uring_server *srv)
+{
+  struct uring *ring = &srv->ring;
+  unsigned head = *ring->cq_head;
+  struct io_uring_cqe *cqe;
+  struct reply_batch *batch;
+
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    if (cqe->user_data == URING_TAG_RECV) {
+      srv->recv_busy = 0;
+      if (cqe->res > 0) {
+        srv->rx_end += cqe->res;
+      } else if ((cqe->res != -EINTR) && (cqe->res != -EAGAIN)) {
+        if (cqe->res < 0)
+          fprintf(stderr, "%s\n", strerror(-cqe->res));
+        srv->eof = 1;
+      }
+    } else if (cqe->user_data == URING_TAG_SEND) {
+      srv->send_busy = 0;
+      batch = srv->sending;
+      batch_finish(srv->sk, &srv->pool, batch, (cqe->res > 0) ? cqe->res : 0);
+    }
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* sends every pending reply, the caller is about to write to sk itself */
+static void uring_drain(struct uring_server *srv)
+{
+  while (srv->send_busy) {
+    if (uring_enter(&srv->ring, 1) < 0)
+      break;
+    uring_reap(srv);
+  }
+  batch_finish(srv->sk, &srv->pool, srv->building, 0);
+}
+
+static void uring_queue_send(struct uring_server *srv)
+{
+  struct reply_batch *batch = srv->building;
+  struct io_uring_sqe *sqe;
+
+  memset(&batch->msg, 0, sizeof(batch->msg));
+  batch->msg.msg_iov = batch->iov;
+  batch->msg.msg_iovlen = batch->iovcnt;
+  sqe = uring_get_sqe(&srv->ring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = srv->sk;
+  sqe->addr = (u_int64_t)(unsigned long)&batch->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_WAITALL;
+  sqe->user_data = URING_TAG_SEND;
+  srv->building = srv->sending;
+  srv->sending = batch;
+  srv->send_busy = 1;
+}
+
+static void uring_queue_recv(struct uring_server *srv)
+{
+  struct io_uring_sqe *sqe;
+  size_t size;
+
+  /* the buffer may only move while no receive is pending */
+  if (srv->rx_start > 0) {
+    memmove(srv->rx, srv->rx + srv->rx_start, srv->rx_end - srv->rx_start);
+    srv->rx_end -= srv->rx_start;
+    srv->rx_start = 0;
+  }
+  if (srv->rx_need > srv->rx_size) {
+    srv->rx = (char*)realloc(srv->rx, srv->rx_need);
+    srv->rx_size = srv->rx_need;
+  }
+  size = srv->rx_size - srv->rx_end;
+  if (size == 0)
+    return;
+  sqe = uring_get_sqe(&srv->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = srv->sk;
+  sqe->addr = (u_int64_t)(unsigned long)(srv->rx + srv->rx_end);
+  sqe->len = size;
+  sqe->user_data = URING_TAG_RECV;
+  srv->recv_busy = 1;
+}
+
+static int serve_uring(int sk, const struct buse_operations *aop,
+                       const struct nbd_session *session, void *userdata)
+{
+  struct uring_server srv;
+  struct nbd_request request;
+  struct nbd_reply reply;
+  struct io_uring_sqe *sqe;
+  u_int64_t from, fd_offset;
+  u_int32_t len, type, flags, chunk_len;
+  char head[NBD_CHUNK_HEADER + 8];
+  size_t need;
+  void *chunk, *payload;
+  int fd, ret, disc = 0;
+
+  memset(&srv, 0, sizeof(srv));
+  if (uring_setup(&srv.ring, URING_ENTRIES, 0) < 0)
+    return -1;
+  srv.sk = sk;
+  pool_init(&srv.pool);
+  srv.rx_size = URING_RX_SIZE;
+  srv.rx = (char*)malloc(srv.rx_size);
+  srv.building = (struct reply_batch*)calloc(1, sizeof(struct reply_batch));
+  srv.sending = (struct reply_batch*)calloc(1, sizeof(struct reply_batch));
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+
+  while (!disc) {
+    /* run every complete request that has arrived */
+    while (srv.building->count < BATCH_REPLIES) {
+      if (srv.rx_end - srv.rx_start < sizeof(request))
+        break;
+      memcpy(&request, srv.rx + srv.rx_start, sizeof(request));
+      len = ntohl(request.len);
+      from = ntohll(request.from);
+      type = ntohl(request.type);
+      flags = type & ~BUSE_CMD_MASK;
+      type &= BUSE_CMD_MASK;
+      if (request.magic != htonl(NBD_REQUEST_MAGIC) ||
+          (type == NBD_CMD_WRITE && len > BUSE_MAX_REQUEST)) {
+        disc = 1;
+        break;
+      }
+      need = sizeof(request) + ((type == NBD_CMD_WRITE) ? len : 0);
+      if (srv.rx_end - srv.rx_start < need) {
+        srv.rx_need = need;
+        break;
+      }
+      srv.rx_need = 0;
+      payload = (type == NBD_CMD_WRITE) ? srv.rx + srv.rx_start + sizeof(request) : NULL;
+      srv.rx_start += need;
+      memcpy(reply.handle, request.handle, sizeof(reply.handle));
+      reply.error = htonl(0);
+
+      if (type == NBD_CMD_READ) {
+        buse_trace(TRACE_NBD_READ, from, len);
+        if (aop->read_fd && check_request(aop, type, from, len) == 0 &&
+            aop->read_fd(&fd, &fd_offset, len, from, userdata) == 0) {
+          uring_drain(&srv);
+          write_all(sk, head, data_header(session, &reply, from, len, head));
+          sendfile_all(sk, fd, (off_t)fd_offset, len);
+          close(fd);
+          continue;
+        }
+      }
+      ret = handle_request(aop, userdata, session, &srv.pool, type, flags, from, len, payload,
+                           &reply, &chunk, &chunk_len);
+      if (ret == REPLY_DISC) {
+        disc = 1;
+        break;
+      }
+      batch_add(srv.building, (ret == REPLY_SIMPLE) ? &reply : NULL, chunk, chunk_len);
+    }
+    if (disc || (srv.eof && (srv.building->count < BATCH_REPLIES)))
+      break;
+
+    /* the previous batch must be out before the next one is sent */
+    if (!srv.send_busy && (srv.building->count > 0))
+      uring_queue_send(&srv);
+    if (!srv.recv_busy && !srv.eof)
+      uring_queue_recv(&srv);
+    if (uring_enter(&srv.ring, 1) < 0) {
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+      break;
+    }
+    uring_reap(&srv);
+  }
+
+  uring_drain(&srv);
+  if (srv.recv_busy) {
+    /* the receive buffer must not be freed under a pending receive */
+    sqe = uring_get_sqe(&srv.ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_TAG_RECV;
+    sqe->user_data = URING_TAG_CANCEL;
+    while (srv.recv_busy && (uring_enter(&srv.ring, 1) >= 0))
+      uring_reap(&srv);
+  }
+  uring_close(&srv.ring);
+  pool_destroy(&srv.pool);
+  free(srv.rx);
+  free(srv.building);
+  free(srv.sending);
+  return 0;
+}
+#endif
+
+/* Only what the callbacks can serve is advertised. FUA needs a way to make
+ * a write durable, write_fua or flush. */
+static u_int32_t nbd_flags(const struct buse_operations *aop)
+{
+  u_int32_t flags = NBD_FLAG_HAS_FLAGS | aop->flags;
+
+  if (aop->flush)
+    flags |= NBD_FLAG_SEND_FLUSH;
+  if (aop->write_fua || aop->flush)
+    flags |= NBD_FLAG_SEND_FUA;
+  if (aop->trim)
+    flags |= NBD_FLAG_SEND_TRIM;
+  if (aop->write_zeroes)
+    flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+  if (aop->cache)
+    flags |= NBD_FLAG_SEND_CACHE;
+  return flags;
+}
+
+/* the kernel negotiates nothing */
+static const struct nbd_session kernel_session = { 0, 0 };
+
+int buse_main(const char* dev_file, const struct buse_operations *aop, void *userdata)
+{
+  int sp[2];
+  int nbd, sk, err, tmp_fd;
 
   err = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
   assert(!err);
@@ -103,6 +1094,8 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
     return 1;
   }
 
+  err = ioctl(nbd, NBD_SET_BLKSIZE, (unsigned long)block_size(aop));
+  assert(err != -1);
   err = ioctl(nbd, NBD_SET_SIZE, aop->size);
   assert(err != -1);
   err = ioctl(nbd, NBD_CLEAR_SOCK);
@@ -116,9 +1109,9 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
     if(ioctl(nbd, NBD_SET_SOCK, sk) == -1){
       fprintf(stderr, "ioctl(nbd, NBD_SET_SOCK, sk) failed.[%s]\n", strerror(errno));
     }
-#if defined NBD_SET_FLAGS && defined NBD_FLAG_SEND_TRIM
-    else if(ioctl(nbd, NBD_SET_FLAGS, NBD_FLAG_SEND_TRIM) == -1){
-      fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, NBD_FLAG_SEND_TRIM) failed.[%s]\n", strerror(errno));
+#if defined NBD_SET_FLAGS
+    else if(ioctl(nbd, NBD_SET_FLAGS, (unsigned long)nbd_flags(aop)) == -1){
+      fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS) failed.[%s]\n", strerror(errno));
     }
 #endif
     else{
@@ -145,79 +1138,823 @@ int buse_main(const char* dev_file, const struct buse_operations *aop, void *use
   close(sp[1]);
   sk = sp[0];
 
-  reply.magic = htonl(NBD_REPLY_MAGIC);
-  reply.error = htonl(0);
+#ifdef BUSE_IO_URING
+  if (serve_uring(sk, aop, &kernel_session, userdata) == 0)
+    return 0;
+#endif
+  return serve(sk, aop, &kernel_session, userdata);
+}
 
-  while ((bytes_read = read(sk, &request, sizeof(request))) > 0) {
-    assert(bytes_read == sizeof(request));
-    memcpy(reply.handle, request.handle, sizeof(reply.handle));
-    reply.error = htonl(0);
+/*
+ * Userspace NBD server: the same operations served to network clients
+ * (nbd-client, qemu-nbd and friends) over a unix or TCP socket, with the
+ * fixed newstyle handshake. Once a client picked the export the connection
+ * is served by the same loops as the kernel's socket.
+ */
+#define NBD_INIT_MAGIC        0x4e42444d41474943ULL  /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC        0x49484156454f5054ULL  /* "IHAVEOPT" */
+#define NBD_REP_MAGIC         0x0003e889045565a9ULL
 
-    len = ntohl(request.len);
-    from = ntohll(request.from);
-    assert(request.magic == htonl(NBD_REQUEST_MAGIC));
-
-    switch(ntohl(request.type)) {
-      /* I may at some point need to deal with the the fact that the
-       * official nbd server has a maximum buffer size, and divides up
-       * oversized requests into multiple pieces. This applies to reads
-       * and writes.
-       */
-    case NBD_CMD_READ:
-      fprintf(stderr, "Request for read of size %d\n", len);
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read) {
-        reply.error = aop->read(chunk, len, from, userdata);
-      } else {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char*)chunk, len);
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_NO_ZEROES        (1 << 1)
+
+#define NBD_OPT_EXPORT_NAME   1
+#define NBD_OPT_ABORT         2
+#define NBD_OPT_LIST          3
+#define NBD_OPT_INFO          6
+#define NBD_OPT_GO            7
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT  10
+
+#define NBD_REP_ACK           1
+#define NBD_REP_SERVER        2
+#define NBD_REP_INFO          3
+#define NBD_REP_META_CONTEXT  4
+#define NBD_REP_ERR_UNSUP     (0x80000000 | 1)
+#define NBD_REP_ERR_INVALID   (0x80000000 | 3)
+
+#define NBD_INFO_EXPORT       0
+#define NBD_INFO_BLOCK_SIZE   3
+
+#define NBD_MAX_OPTION_LEN    4096
+#define BUSE_PREFERRED_BLOCK  4096
+
+struct nbd_client {
+  int sk;
+  int done;
+  struct nbd_session session;
+  pthread_t thread;
+  const struct buse_operations *aop;
+  void *userdata;
+  struct nbd_client *next;
+};
 
-      free(chunk);
+static int opt_reply(int sk, u_int32_t opt, u_int32_t type, const void *data, u_int32_t len)
+{
+  char head[20];
+  u_int64_t magic = htonll(NBD_REP_MAGIC);
+
+  opt = htonl(opt);
+  type = htonl(type);
+  memcpy(head, &magic, 8);
+  memcpy(head + 8, &opt, 4);
+  memcpy(head + 12, &type, 4);
+  type = htonl(len);
+  memcpy(head + 16, &type, 4);
+  if (write_all(sk, head, sizeof(head)) < 0)
+    return -1;
+  return (len > 0) ? write_all(sk, (char*)data, len) : 0;
+}
+
+/* NBD_INFO_EXPORT and NBD_INFO_BLOCK_SIZE are sent whether asked for or
+ * not, requests have to be sector aligned. */
+static int opt_info(int sk, u_int32_t opt, const struct buse_operations *aop, u_int16_t flags)
+{
+  char info[14];
+  u_int16_t type;
+  u_int64_t size = htonll(aop->size);
+  u_int32_t sizes[3];
+
+  type = htons(NBD_INFO_EXPORT);
+  flags = htons(flags);
+  memcpy(info, &type, 2);
+  memcpy(info + 2, &size, 8);
+  memcpy(info + 10, &flags, 2);
+  if (opt_reply(sk, opt, NBD_REP_INFO, info, 12) < 0)
+    return -1;
+  type = htons(NBD_INFO_BLOCK_SIZE);
+  sizes[0] = htonl(block_size(aop));
+  sizes[1] = htonl((block_size(aop) > BUSE_PREFERRED_BLOCK) ? block_size(aop) : BUSE_PREFERRED_BLOCK);
+  sizes[2] = htonl(BUSE_MAX_REQUEST);
+  memcpy(info, &type, 2);
+  memcpy(info + 2, sizes, sizeof(sizes));
+  if (opt_reply(sk, opt, NBD_REP_INFO, info, 14) < 0)
+    return -1;
+  return opt_reply(sk, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * base:allocation is the only metadata context, offered if the operations
+ * can tell holes from data. A query list is validated as a whole before
+ * SET_META_CONTEXT changes anything.
+ */
+static int opt_meta_context(int sk, u_int32_t opt, const char *data, u_int32_t len,
+                            const struct buse_operations *aop, struct nbd_session *session)
+{
+  static const char context[] = "base:allocation";
+  char rep[4 + sizeof(context) - 1];
+  u_int32_t namelen, queries, qlen, pos, i, id;
+  int match = 0;
+
+  if (opt == NBD_OPT_SET_META_CONTEXT && !session->structured)
+    return opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+  if (len < 8)
+    return opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+  memcpy(&namelen, data, 4);
+  namelen = ntohl(namelen);
+  if (namelen > len - 8)
+    return opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+  pos = 4 + namelen;
+  memcpy(&queries, data + pos, 4);
+  queries = ntohl(queries);
+  pos += 4;
+  for (i = 0; i < queries; i++) {
+    if (len - pos < 4)
+      return opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+    memcpy(&qlen, data + pos, 4);
+    qlen = ntohl(qlen);
+    pos += 4;
+    if (qlen > len - pos)
+      return opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+    if (qlen == sizeof(context) - 1 && memcmp(data + pos, context, qlen) == 0)
+      match = 1;
+    /* listing may ask for a whole namespace */
+    if (opt == NBD_OPT_LIST_META_CONTEXT && qlen == 5 && memcmp(data + pos, context, 5) == 0)
+      match = 1;
+    pos += qlen;
+  }
+  if (pos != len)
+    return opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+  if (queries == 0 && opt == NBD_OPT_LIST_META_CONTEXT)
+    match = 1;
+  match = match && (aop->block_status != NULL);
+
+  if (opt == NBD_OPT_SET_META_CONTEXT)
+    session->base_allocation = match;
+  if (match) {
+    id = htonl((opt == NBD_OPT_SET_META_CONTEXT) ? BUSE_CONTEXT_ALLOCATION : 0);
+    memcpy(rep, &id, 4);
+    memcpy(rep + 4, context, sizeof(context) - 1);
+    if (opt_reply(sk, opt, NBD_REP_META_CONTEXT, rep, sizeof(rep)) < 0)
+      return -1;
+  }
+  return opt_reply(sk, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Runs the handshake. Returns 0 once the client moved on to transmission,
+ * -1 if it aborted or broke the protocol. There is a single export, any
+ * name selects it.
+ */
+static int negotiate(int sk, const struct buse_operations *aop, struct nbd_session *session)
+{
+  char head[18], *data;
+  u_int64_t magic;
+  u_int32_t cflags, opt, len, namelen;
+  u_int16_t hflags, tflags;
+  int ret;
+
+  tflags = (u_int16_t)nbd_flags(aop) | NBD_FLAG_SEND_DF;
+  if (aop->flush)
+    tflags |= NBD_FLAG_CAN_MULTI_CONN;  /* a flush covers every connection */
+
+  magic = htonll(NBD_INIT_MAGIC);
+  memcpy(head, &magic, 8);
+  magic = htonll(NBD_OPTS_MAGIC);
+  memcpy(head + 8, &magic, 8);
+  hflags = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  memcpy(head + 16, &hflags, 2);
+  if (write_all(sk, head, 18) < 0 || read_all(sk, (char*)&cflags, 4) < 0)
+    return -1;
+  cflags = ntohl(cflags);
+  if (!(cflags & NBD_FLAG_FIXED_NEWSTYLE))
+    return -1;
+
+  for (;;) {
+    if (read_all(sk, head, 16) < 0)
+      return -1;
+    memcpy(&magic, head, 8);
+    memcpy(&opt, head + 8, 4);
+    memcpy(&len, head + 12, 4);
+    opt = ntohl(opt);
+    len = ntohl(len);
+    if (ntohll(magic) != NBD_OPTS_MAGIC)
+      return -1;
+    if (len > NBD_MAX_OPTION_LEN) {
+      if (opt == NBD_OPT_EXPORT_NAME || skip_all(sk, len) < 0 ||
+          opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0) < 0)
+        return -1;
+      continue;
+    }
+    data = (char*)malloc(len + 1);
+    if (data == NULL || read_all(sk, data, len) < 0) {
+      free(data);
+      return -1;
+    }
+
+    switch (opt) {
+    case NBD_OPT_EXPORT_NAME: {
+      char reply[134];
+      u_int64_t size = htonll(aop->size);
+      u_int16_t flags = htons(tflags);
+
+      free(data);
+      memset(reply, 0, sizeof(reply));
+      memcpy(reply, &size, 8);
+      memcpy(reply + 8, &flags, 2);
+      return write_all(sk, reply, (cflags & NBD_FLAG_NO_ZEROES) ? 10 : 134);
+    }
+    case NBD_OPT_ABORT:
+      free(data);
+      opt_reply(sk, opt, NBD_REP_ACK, NULL, 0);
+      return -1;
+    case NBD_OPT_LIST:
+      namelen = 0;
+      ret = opt_reply(sk, opt, NBD_REP_SERVER, &namelen, 4);
+      if (ret == 0)
+        ret = opt_reply(sk, opt, NBD_REP_ACK, NULL, 0);
       break;
-    case NBD_CMD_WRITE:
-      fprintf(stderr, "Request for write of size %d\n", len);
-      chunk = malloc(len);
-      read_all(sk, (char*)chunk, len);
-      if (aop->write) {
-        reply.error = aop->write(chunk, len, from, userdata);
-      } else {
-        /* If user not specified write operation, return EPERM error */
-        reply.error = htonl(EPERM);
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO: {
+      u_int16_t requests = 0;
+
+      /* export name, then a list of the information requested */
+      if (len >= 6) {
+        memcpy(&namelen, data, 4);
+        namelen = ntohl(namelen);
+        if (namelen <= len - 6) {
+          memcpy(&requests, data + 4 + namelen, 2);
+          requests = ntohs(requests);
+        }
       }
-      free(chunk);
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
-      break;
-    case NBD_CMD_DISC:
-      /* Handle a disconnect request. */
-      if (aop->disc) {
-        aop->disc(userdata);
+      if (len < 6 || namelen > len - 6 || len != 6 + namelen + 2 * (u_int32_t)requests) {
+        ret = opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+        break;
       }
-      return 0;
-#ifdef NBD_FLAG_SEND_FLUSH
-    case NBD_CMD_FLUSH:
-      if (aop->flush) {
-        reply.error = aop->flush(userdata);
+      ret = opt_info(sk, opt, aop, tflags);
+      if (ret == 0 && opt == NBD_OPT_GO) {
+        free(data);
+        return 0;
       }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
       break;
-#endif
-#ifdef NBD_FLAG_SEND_TRIM
-    case NBD_CMD_TRIM:
-      if (aop->trim) {
-        reply.error = aop->trim(from, len, userdata);
+    }
+    case NBD_OPT_STRUCTURED_REPLY:
+      if (len != 0) {
+        ret = opt_reply(sk, opt, NBD_REP_ERR_INVALID, NULL, 0);
+      } else {
+        session->structured = 1;
+        ret = opt_reply(sk, opt, NBD_REP_ACK, NULL, 0);
       }
-      write_all(sk, (char*)&reply, sizeof(struct nbd_reply));
       break;
-#endif
+    case NBD_OPT_LIST_META_CONTEXT:
+    case NBD_OPT_SET_META_CONTEXT:
+      ret = opt_meta_context(sk, opt, data, len, aop, session);
+      break;
     default:
-      assert(0);
+      ret = opt_reply(sk, opt, NBD_REP_ERR_UNSUP, NULL, 0);
+      break;
+    }
+    free(data);
+    if (ret < 0)
+      return -1;
+  }
+}
+
+static void *serve_client(void *arg)
+{
+  struct nbd_client *client = (struct nbd_client *)arg;
+
+  if (negotiate(client->sk, client->aop, &client->session) == 0) {
+#ifdef BUSE_IO_URING
+    if (serve_uring(client->sk, client->aop, &client->session, client->userdata) != 0)
+#endif
+      serve(client->sk, client->aop, &client->session, client->userdata);
+  }
+  __atomic_store_n(&client->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void reap_clients(struct nbd_client **clients, int all)
+{
+  struct nbd_client **link = clients, *client;
+
+  while ((client = *link) != NULL) {
+    if (all)
+      shutdown(client->sk, SHUT_RDWR);
+    if (all || __atomic_load_n(&client->done, __ATOMIC_ACQUIRE)) {
+      pthread_join(client->thread, NULL);
+      close(client->sk);
+      *link = client->next;
+      free(client);
+    } else {
+      link = &client->next;
     }
   }
-  if (bytes_read == -1)
-    fprintf(stderr, "%s\n", strerror(errno));
+}
+
+/* "unix:PATH" or anything with a '/' is a unix socket, else [HOST]:PORT */
+static int listen_on(const char *address)
+{
+  struct addrinfo hints, *res, *ai;
+  struct sockaddr_un sun;
+  struct stat st;
+  char host[256];
+  const char *port;
+  int sk, one = 1;
+
+  if (strncmp(address, "unix:", 5) == 0 || strchr(address, '/') != NULL) {
+    if (strncmp(address, "unix:", 5) == 0)
+      address += 5;
+    if (strlen(address) >= sizeof(sun.sun_path))
+      return -1;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, address);
+    /* a stale socket from an earlier run, nothing else is removed */
+    if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(address);
+    sk = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sk < 0)
+      return -1;
+    if (bind(sk, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(sk, SOMAXCONN) < 0) {
+      close(sk);
+      return -1;
+    }
+    return sk;
+  }
+
+  port = strrchr(address, ':');
+  if (port == NULL || (size_t)(port - address) >= sizeof(host))
+    return -1;
+  memcpy(host, address, port - address);
+  host[port - address] = '\0';
+  port++;
+  if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+    memmove(host, host + 1, strlen(host));
+    host[strlen(host) - 1] = '\0';
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0)
+    return -1;
+  sk = -1;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    sk = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sk < 0)
+      continue;
+    setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sk, ai->ai_addr, ai->ai_addrlen) == 0 && listen(sk, SOMAXCONN) == 0)
+      break;
+    close(sk);
+    sk = -1;
+  }
+  freeaddrinfo(res);
+  return sk;
+}
+
+int buse_serve(const char *address, const struct buse_operations *aop, void *userdata)
+{
+  struct nbd_client *clients = NULL, *client;
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
+  sigset_t all, old;
+  int lsk, sk, one = 1;
+
+  lsk = listen_on(address);
+  if (lsk < 0) {
+    fprintf(stderr, "Failed to listen on `%s': %s\n", address, strerror(errno));
+    return 1;
+  }
+  /* a client going away must not take the server with it */
+  signal(SIGPIPE, SIG_IGN);
+  buse_log(BUSE_LOG_INFO, "Serving NBD on %s\n", address);
+
+  for (;;) {
+    peer_len = sizeof(peer);
+    sk = accept(lsk, (struct sockaddr *)&peer, &peer_len);
+    if (sk < 0) {
+      if (errno == EINTR)
+        break;
+      if (errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "accept: %s\n", strerror(errno));
+      break;
+    }
+    if (peer.ss_family != AF_UNIX)
+      setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    reap_clients(&clients, 0);
+    client = (struct nbd_client *)calloc(1, sizeof(*client));
+    if (client == NULL) {
+      close(sk);
+      continue;
+    }
+    client->sk = sk;
+    client->aop = aop;
+    client->userdata = userdata;
+    /* signals are for the listener, see below */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&client->thread, NULL, serve_client, client) != 0) {
+      close(sk);
+      free(client);
+    } else {
+      client->next = clients;
+      clients = client;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+
+  /* interrupted by a signal: hang up on every client and wait for them */
+  close(lsk);
+  reap_clients(&clients, 1);
   return 0;
 }
+
+/*
+ * ublk backend: the operations behind a ublk_drv device (/dev/ublkbN).
+ * Requests are not streamed through a socket, every hardware queue has a
+ * thread with its own io_uring. For every tag of the queue the thread keeps
+ * a FETCH_REQ command outstanding; it completes with the request described
+ * in the descriptor array mmap()ed from /dev/ublkcN, the data of a write
+ * already copied into the tag's buffer. The result goes back with
+ * COMMIT_AND_FETCH_REQ, which also waits for the next request on the tag,
+ * and all commits of a batch are submitted with one io_uring_enter().
+ */
+#ifdef BUSE_UBLK
+#ifndef UBLK_U_CMD_ADD_DEV
+#define UBLK_U_CMD_ADD_DEV    _IOWR('u', UBLK_CMD_ADD_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_DEL_DEV    _IOWR('u', UBLK_CMD_DEL_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_START_DEV  _IOWR('u', UBLK_CMD_START_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_STOP_DEV   _IOWR('u', UBLK_CMD_STOP_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_SET_PARAMS _IOWR('u', UBLK_CMD_SET_PARAMS, struct ublksrv_ctrl_cmd)
+#define UBLK_U_IO_FETCH_REQ   _IOWR('u', UBLK_IO_FETCH_REQ, struct ublksrv_io_cmd)
+#define UBLK_U_IO_COMMIT_AND_FETCH_REQ \
+  _IOWR('u', UBLK_IO_COMMIT_AND_FETCH_REQ, struct ublksrv_io_cmd)
+#endif
+
+#define UBLK_CONTROL      "/dev/ublk-control"
+#define UBLK_MAX_QUEUES   16
+#define UBLK_DEPTH        64
+#define UBLK_MAX_IO       (512 * 1024)
+#define UBLK_CTRL_ENTRIES 4
+#define UBLK_OPEN_TRIES   100  /* udev creates the char device, wait 1s at most */
+
+struct ublk_dev;
+
+struct ublk_queue {
+  struct ublk_dev *dev;
+  int q_id;
+  struct uring ring;
+  const struct ublksrv_io_desc *descs;
+  size_t descs_size;
+  char *bufs;
+  pthread_t thread;
+  int running;
+};
+
+struct ublk_dev {
+  int ctrl_fd, cdev;
+  struct uring ctrl;
+  struct ublksrv_ctrl_dev_info info;
+  const struct buse_operations *aop;
+  void *userdata;
+  int events[2];  /* pipe, a queue writes 'r' once it fetches, 'x' as it exits */
+  struct ublk_queue queues[UBLK_MAX_QUEUES];
+};
+
+/* Runs a command on the control device and returns its result. */
+static int ublk_ctrl(struct ublk_dev *dev, u_int32_t op, void *buf, u_int16_t len, u_int64_t data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&dev->ctrl);
+  struct ublksrv_ctrl_cmd *cmd = (struct ublksrv_ctrl_cmd *)sqe->cmd;
+  unsigned head = *dev->ctrl.cq_head;
+  int ret;
+
+  sqe->opcode = IORING_OP_URING_CMD;
+  sqe->fd = dev->ctrl_fd;
+  sqe->cmd_op = op;
+  cmd->dev_id = dev->info.dev_id;
+  cmd->queue_id = (u_int16_t)-1;
+  cmd->addr = (u_int64_t)(unsigned long)buf;
+  cmd->len = len;
+  cmd->data[0] = data;
+  while (head == __atomic_load_n(dev->ctrl.cq_tail, __ATOMIC_ACQUIRE)) {
+    if (uring_enter(&dev->ctrl, 1) < 0)
+      return -errno;
+  }
+  ret = dev->ctrl.cqes[head & *dev->ctrl.cq_mask].res;
+  __atomic_store_n(dev->ctrl.cq_head, head + 1, __ATOMIC_RELEASE);
+  return ret;
+}
+
+static int ublk_set_params(struct ublk_dev *dev)
+{
+  const struct buse_operations *aop = dev->aop;
+  struct ublk_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.len = sizeof(params);
+  params.types = UBLK_PARAM_TYPE_BASIC;
+  if (aop->flush)
+    params.basic.attrs |= UBLK_ATTR_VOLATILE_CACHE;
+  if (aop->write_fua || aop->flush)
+    params.basic.attrs |= UBLK_ATTR_FUA;
+  if (aop->flags & NBD_FLAG_ROTATIONAL)
+    params.basic.attrs |= UBLK_ATTR_ROTATIONAL;
+  params.basic.logical_bs_shift = __builtin_ctz(block_size(aop));
+  params.basic.physical_bs_shift = (params.basic.logical_bs_shift > 12) ?
+                                   params.basic.logical_bs_shift : 12;
+  params.basic.io_min_shift = params.basic.logical_bs_shift;
+  params.basic.io_opt_shift = 12;
+  params.basic.max_sectors = UBLK_MAX_IO >> 9;
+  params.basic.dev_sectors = aop->size >> 9;
+  if (aop->trim || aop->write_zeroes) {
+    params.types |= UBLK_PARAM_TYPE_DISCARD;
+    params.discard.discard_granularity = BUSE_PREFERRED_BLOCK;
+    params.discard.max_discard_sectors = aop->trim ? (BUSE_MAX_REQUEST >> 9) : 0;
+    params.discard.max_write_zeroes_sectors = aop->write_zeroes ? (BUSE_MAX_REQUEST >> 9) : 0;
+    params.discard.max_discard_segments = 1;
+  }
+  return ublk_ctrl(dev, UBLK_U_CMD_SET_PARAMS, &params, sizeof(params), 0);
+}
+
+static void ublk_queue_cmd(struct ublk_queue *q, u_int32_t op, int tag, int result)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&q->ring);
+  struct ublksrv_io_cmd *cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+
+  sqe->opcode = IORING_OP_URING_CMD;
+  sqe->fd = q->dev->cdev;
+  sqe->cmd_op = op;
+  sqe->user_data = tag;
+  cmd->q_id = q->q_id;
+  cmd->tag = tag;
+  cmd->result = result;
+  cmd->addr = (u_int64_t)(unsigned long)(q->bufs + (size_t)tag * UBLK_MAX_IO);
+}
+
+/*
+ * Runs the request on a tag. Everything but a read goes through
+ * handle_request() as the NBD command it corresponds to; reads land in the
+ * tag's buffer directly. Returns the byte count or -errno.
+ */
+static int ublk_handle(struct ublk_queue *q, int tag)
+{
+  const struct ublksrv_io_desc *iod = &q->descs[tag];
+  const struct buse_operations *aop = q->dev->aop;
+  void *userdata = q->dev->userdata;
+  char *buf = q->bufs + (size_t)tag * UBLK_MAX_IO;
+  u_int64_t from = iod->start_sector << 9;
+  u_int32_t len = iod->nr_sectors << 9;
+  u_int32_t type, flags = 0;
+  struct nbd_reply reply;
+  u_int32_t chunk_len;
+  void *chunk;
+
+  switch (ublksrv_get_op(iod)) {
+  case UBLK_IO_OP_READ:
+    buse_trace(TRACE_NBD_READ, from, len);
+    if (check_request(aop, NBD_CMD_READ, from, len) != 0)
+      return -EINVAL;
+    if (aop->read == NULL)
+      return -EPERM;
+    return aop->read(buf, len, from, userdata) ? -EIO : (int)len;
+  case UBLK_IO_OP_WRITE:
+    type = NBD_CMD_WRITE;
+    break;
+  case UBLK_IO_OP_FLUSH:
+    type = NBD_CMD_FLUSH;
+    break;
+  case UBLK_IO_OP_DISCARD:
+    type = NBD_CMD_TRIM;
+    break;
+  case UBLK_IO_OP_WRITE_ZEROES:
+    type = BUSE_CMD_WRITE_ZEROES;
+    break;
+  default:
+    return -EOPNOTSUPP;
+  }
+  if (iod->op_flags & UBLK_IO_F_FUA)
+    flags |= NBD_CMD_FLAG_FUA;
+  handle_request(aop, userdata, &kernel_session, NULL, type, flags, from, len, buf,
+                 &reply, &chunk, &chunk_len);
+  if (reply.error != 0)
+    return -EIO;
+  return (type == NBD_CMD_WRITE) ? (int)len : 0;
+}
+
+static void ublk_event(struct ublk_dev *dev, char ev)
+{
+  write_all(dev->events[1], &ev, 1);
+}
+
+static void *ublk_queue_thread(void *arg)
+{
+  struct ublk_queue *q = (struct ublk_queue *)arg;
+  struct ublk_dev *dev = q->dev;
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  int tag, active = 0;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t stride = (UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc) + page - 1) & ~(page - 1);
+
+  /* the driver wants commands of a queue from the thread that fetches */
+  if (uring_setup(&q->ring, dev->info.queue_depth, 0) < 0)
+    goto out;
+  q->descs_size = (dev->info.queue_depth * sizeof(struct ublksrv_io_desc) + page - 1) & ~(page - 1);
+  q->descs = (const struct ublksrv_io_desc *)mmap(NULL, q->descs_size, PROT_READ,
+                                                  MAP_SHARED | MAP_POPULATE, dev->cdev,
+                                                  UBLKSRV_CMD_BUF_OFFSET + q->q_id * stride);
+  if (q->descs == MAP_FAILED)
+    goto out_ring;
+  /* only the pages of tags that see large requests get touched */
+  q->bufs = (char*)mmap(NULL, (size_t)dev->info.queue_depth * UBLK_MAX_IO, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (q->bufs == MAP_FAILED)
+    goto out_descs;
+
+  for (tag = 0; tag < dev->info.queue_depth; tag++)
+    ublk_queue_cmd(q, UBLK_U_IO_FETCH_REQ, tag, 0);
+  if (uring_enter(&q->ring, 0) < 0)
+    goto out_bufs;
+  active = dev->info.queue_depth;
+  ublk_event(dev, 'r');
+
+  while (active > 0) {
+    if (uring_enter(&q->ring, 1) < 0) {
+      fprintf(stderr, "ublk queue %d: %s\n", q->q_id, strerror(errno));
+      break;
+    }
+    head = *q->ring.cq_head;
+    while (head != __atomic_load_n(q->ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &q->ring.cqes[head & *q->ring.cq_mask];
+      tag = (int)cqe->user_data;
+      if (cqe->res == UBLK_IO_RES_OK) {
+        ublk_queue_cmd(q, UBLK_U_IO_COMMIT_AND_FETCH_REQ, tag, ublk_handle(q, tag));
+      } else {
+        /* UBLK_IO_RES_ABORT: the device is stopping, the tag is done */
+        if (cqe->res != UBLK_IO_RES_ABORT)
+          fprintf(stderr, "ublk queue %d tag %d: %s\n", q->q_id, tag, strerror(-cqe->res));
+        active--;
+      }
+      head++;
+    }
+    __atomic_store_n(q->ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+out_bufs:
+  munmap(q->bufs, (size_t)dev->info.queue_depth * UBLK_MAX_IO);
+out_descs:
+  munmap((void *)q->descs, q->descs_size);
+out_ring:
+  uring_close(&q->ring);
+out:
+  ublk_event(dev, 'x');
+  return NULL;
+}
+
+static int ublk_open_cdev(struct ublk_dev *dev)
+{
+  struct timespec delay = { 0, 10 * 1000000L };
+  char path[64];
+  int tries;
+
+  snprintf(path, sizeof(path), "/dev/ublkc%u", dev->info.dev_id);
+  for (tries = 0; tries < UBLK_OPEN_TRIES; tries++) {
+    dev->cdev = open(path, O_RDWR);
+    if (dev->cdev >= 0 || errno != ENOENT)
+      break;
+    nanosleep(&delay, NULL);
+  }
+  if (dev->cdev < 0)
+    fprintf(stderr, "Failed to open `%s': %s\n", path, strerror(errno));
+  return dev->cdev;
+}
+
+int buse_ublk(int queues, const struct buse_operations *aop, void *userdata)
+{
+  struct ublk_dev *dev;
+  struct pollfd pfd;
+  sigset_t all, old;
+  int i, ret, ready = 0, failed = 0;
+  char ev;
+
+  if (queues < 1)
+    queues = 1;
+  if (queues > UBLK_MAX_QUEUES)
+    queues = UBLK_MAX_QUEUES;
+  dev = (struct ublk_dev *)calloc(1, sizeof(*dev));
+  if (dev == NULL)
+    return 1;
+  dev->aop = aop;
+  dev->userdata = userdata;
+  dev->cdev = -1;
+  dev->ctrl_fd = open(UBLK_CONTROL, O_RDWR);
+  if (dev->ctrl_fd < 0) {
+    fprintf(stderr,
+        "Failed to open `%s': %s\n"
+        "Is kernel module `ublk_drv' loaded and you have permissions "
+        "to access it?\n", UBLK_CONTROL, strerror(errno));
+    free(dev);
+    return 1;
+  }
+  if (uring_setup(&dev->ctrl, UBLK_CTRL_ENTRIES, IORING_SETUP_SQE128) < 0) {
+    fprintf(stderr, "ublk needs io_uring with 128 byte entries\n");
+    close(dev->ctrl_fd);
+    free(dev);
+    return 1;
+  }
+  if (pipe(dev->events) < 0) {
+    uring_close(&dev->ctrl);
+    close(dev->ctrl_fd);
+    free(dev);
+    return 1;
+  }
+
+  dev->info.nr_hw_queues = queues;
+  dev->info.queue_depth = UBLK_DEPTH;
+  dev->info.max_io_buf_bytes = UBLK_MAX_IO;
+  dev->info.dev_id = (u_int32_t)-1;
+  dev->info.ublksrv_pid = getpid();
+  ret = ublk_ctrl(dev, UBLK_U_CMD_ADD_DEV, &dev->info, sizeof(dev->info), 0);
+  if (ret < 0) {
+    fprintf(stderr, "ublk: adding a device failed: %s\n", strerror(-ret));
+    failed = 1;
+    goto out;
+  }
+  ret = ublk_set_params(dev);
+  if (ret < 0) {
+    fprintf(stderr, "ublk: setting parameters failed: %s\n", strerror(-ret));
+    failed = 1;
+    goto out_del;
+  }
+  if (ublk_open_cdev(dev) < 0) {
+    failed = 1;
+    goto out_del;
+  }
+
+  /* signals are for this thread, see below */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i = 0; i < dev->info.nr_hw_queues; i++) {
+    dev->queues[i].dev = dev;
+    dev->queues[i].q_id = i;
+    if (pthread_create(&dev->queues[i].thread, NULL, ublk_queue_thread, &dev->queues[i]) != 0)
+      break;
+    dev->queues[i].running = 1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  /* the device can only start once every tag is fetched */
+  failed = (i < dev->info.nr_hw_queues);
+  while (!failed && ready < dev->info.nr_hw_queues) {
+    if (read(dev->events[0], &ev, 1) != 1) {
+      if (errno == EINTR)
+        break;
+      failed = 1;
+    } else if (ev == 'r') {
+      ready++;
+    } else {
+      failed = 1;
+    }
+  }
+  if (!failed && ready == dev->info.nr_hw_queues) {
+    ret = ublk_ctrl(dev, UBLK_U_CMD_START_DEV, NULL, 0, getpid());
+    if (ret < 0) {
+      fprintf(stderr, "ublk: starting the device failed: %s\n", strerror(-ret));
+      failed = 1;
+    } else {
+      buse_log(BUSE_LOG_INFO, "Serving /dev/ublkb%u with %d queues\n", dev->info.dev_id,
+               dev->info.nr_hw_queues);
+      /* until a signal or a queue giving up, e.g. the device was deleted */
+      pfd.fd = dev->events[0];
+      pfd.events = POLLIN;
+      while (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        ;
+    }
+  }
+
+  ublk_ctrl(dev, UBLK_U_CMD_STOP_DEV, NULL, 0, 0);
+  for (i = 0; i < dev->info.nr_hw_queues; i++) {
+    if (dev->queues[i].running)
+      pthread_join(dev->queues[i].thread, NULL);
+  }
+  /* the device is only deleted once nothing has it open */
+  close(dev->cdev);
+out_del:
+  ublk_ctrl(dev, UBLK_U_CMD_DEL_DEV, NULL, 0, 0);
+  if (!failed && aop->disc)
+    aop->disc(userdata);
+out:
+  close(dev->events[0]);
+  close(dev->events[1]);
+  uring_close(&dev->ctrl);
+  close(dev->ctrl_fd);
+  free(dev);
+  return failed;
+}
+#else
+int buse_ublk(int queues, const struct buse_operations *aop, void *userdata)
+{
+  (void)queues;
+  (void)aop;
+  (void)userdata;
+  fprintf(stderr, "Built without ublk support (needs <linux/ublk_cmd.h>)\n");
+  return 1;
+}
+#endif
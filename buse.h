@@ -10,18 +10,101 @@ extern "C" {
 #include <sys/types.h>
 #include <linux/nbd.h>
 
+  /* Protocol bits older kernel headers don't have. The kernel enum may
+   * already name the commands, so ours carry a BUSE_ prefix. */
+#ifndef NBD_CMD_FLAG_FUA
+#define NBD_CMD_FLAG_FUA           (1 << 16)
+#endif
+#ifndef NBD_FLAG_ROTATIONAL
+#define NBD_FLAG_ROTATIONAL        (1 << 4)
+#endif
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#endif
+#ifndef NBD_FLAG_SEND_CACHE
+#define NBD_FLAG_SEND_CACHE        (1 << 10)
+#endif
+#ifndef NBD_FLAG_SEND_DF
+#define NBD_FLAG_SEND_DF           (1 << 7)
+#endif
+#define BUSE_CMD_CACHE             5
+#define BUSE_CMD_WRITE_ZEROES      6
+#define BUSE_CMD_BLOCK_STATUS      7
+#define BUSE_CMD_MASK              0xffff  /* the rest of the type is flags */
+#define BUSE_CMD_FLAG_DF           (1 << 18)
+#define BUSE_CMD_FLAG_REQ_ONE      (1 << 19)
+
+  /* base:allocation block status */
+#ifndef NBD_STATE_HOLE
+#define NBD_STATE_HOLE             (1 << 0)
+#define NBD_STATE_ZERO             (1 << 1)
+#endif
+
+  struct buse_extent {
+    u_int32_t length;
+    u_int32_t flags;   /* NBD_STATE_* */
+  };
+
   struct buse_operations {
     int (*read)(void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     int (*write)(const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
     void (*disc)(void *userdata);
     int (*flush)(void *userdata);
     int (*trim)(u_int64_t from, u_int32_t len, void *userdata);
+    /* Optional: returns 0 and a descriptor the caller closes if the read can
+     * be sent straight from *fd at *fd_offset, without a copy through read. */
+    int (*read_fd)(int *fd, u_int64_t *fd_offset, u_int32_t len, u_int64_t offset, void *userdata);
+    /* Optional: a write that must be durable when it returns (FUA). Without
+     * it such writes are followed by a flush. */
+    int (*write_fua)(const void *buf, u_int32_t len, u_int64_t offset, void *userdata);
+    /* Optional: zero a range, no payload is transferred. */
+    int (*write_zeroes)(u_int64_t from, u_int32_t len, int fua, void *userdata);
+    /* Optional: readahead hint, the range is about to be read. */
+    int (*cache)(u_int64_t from, u_int32_t len, void *userdata);
+    /* Optional: describes the range as at most max extents, which may end
+     * short of it. Returns the number filled in. Lets network clients skip
+     * holes, see buse_serve(). */
+    int (*block_status)(u_int64_t from, u_int32_t len, struct buse_extent *extents,
+                        int max, void *userdata);
 
     u_int64_t size;
+    u_int32_t flags;  /* advertised in addition, e.g. NBD_FLAG_ROTATIONAL */
+    u_int32_t block_size;  /* logical block size, 512 if 0; requests are
+                            * multiples of it */
+  };
+
+  /* Request buffer pools, summed over all connections so far. */
+  struct buse_pool_stats {
+    u_int64_t gets;         /* buffers handed out */
+    u_int64_t hits;         /* ... of those reused from the pool */
+    u_int64_t allocs;       /* fresh allocations */
+    u_int64_t huge_allocs;  /* ... of those backed by huge pages */
+    u_int64_t cached_bytes; /* idle in the pools of live connections */
+    u_int64_t peak_bytes;   /* most one connection ever allocated at once */
   };
 
+  /* Back buffers of 2M and up with huge pages where available. */
+  extern int buse_use_hugepages;
+
+  void buse_get_pool_stats(struct buse_pool_stats *stats);
+
   int buse_main(const char* dev_file, const struct buse_operations *bop, void *userdata);
 
+  /* Serves the operations to NBD clients instead of the kernel driver.
+   * address is a unix socket ("unix:PATH", or any path with a '/') or
+   * [HOST]:PORT for TCP. Every client runs on its own thread, so the
+   * callbacks must be thread safe. Returns 0 once a signal with a handler
+   * interrupts the listener, after all clients were disconnected, and 1 if
+   * it can't listen. */
+  int buse_serve(const char *address, const struct buse_operations *bop, void *userdata);
+
+  /* Exposes the operations as a ublk device, /dev/ublkbN (needs the
+   * ublk_drv module), instead of an nbd one. Each of the queues hardware
+   * queues is served by its own thread, so the callbacks must be thread
+   * safe. Returns 0 once a signal with a handler interrupts it or the device
+   * was deleted, after it was removed, and 1 if it can't be set up. */
+  int buse_ublk(int queues, const struct buse_operations *bop, void *userdata);
+
 #ifdef __cplusplus
 }
 #endif
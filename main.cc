@@ -17,23 +17,58 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "buse.h"
+#include "trace.h"
 #include "vvfat.h"
 
 static void *data;
 static int xmpl_debug = 1;
 
-static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+/* Commits to the host directory run on their own thread, so every access to
+ * the image is serialized through this lock. */
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t committer;
+static volatile int committer_stop = 0;
+static int commit_interval = 5;
+static int write_through = 0;
+static const char *listen_address = NULL;
+static int ublk_queues = 0;
+static int lazy_depth = 0;
+
+/* With continuous sync the committer polls every SYNC_POLL_MS and commits
+ * once the guest stopped writing for SYNC_IDLE_MS, or SYNC_MAX_LAG_MS after
+ * the first write not yet on the host, whichever comes first. */
+#define SYNC_POLL_MS    100
+#define SYNC_IDLE_MS    200
+#define SYNC_MAX_LAG_MS 1000
+static int continuous_sync = 0;
+static struct timespec first_write, last_write;
+
+static long elapsed_ms(const struct timespec *since)
 {
-    fprintf(stderr, "R - %lu, %u\n", offset, len);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
 
+static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
     vvfat_image_t *image = (vvfat_image_t*)userdata;
+    pthread_mutex_lock(&image_lock);
     image->lseek(offset, SEEK_SET);
     int ret = image->read(buf, len);
+    pthread_mutex_unlock(&image_lock);
 
     if (ret < 0) {
         return ret;
@@ -42,12 +77,43 @@ static int xmp_read(void *buf, u_int32_t len, u_int64_t offset, void *userdata)
     return 0;
 }
 
-static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+/* Reads of unmodified file data are sent from the host file by buse_main.
+ * The descriptor is a dup(), it stays valid once the lock is dropped. */
+static int xmp_read_fd(int *fd, u_int64_t *fd_offset, u_int32_t len, u_int64_t offset, void *userdata)
 {
+    off_t file_offset;
+
     vvfat_image_t *image = (vvfat_image_t*)userdata;
+    pthread_mutex_lock(&image_lock);
     image->lseek(offset, SEEK_SET);
-    int ret = image->write(buf, len);
-    image->commit_changes();
+    *fd = image->map_read(len, &file_offset);
+    pthread_mutex_unlock(&image_lock);
+
+    if (*fd < 0) {
+        return -1;
+    }
+
+    buse_trace(TRACE_READ_FD, offset, len);
+    *fd_offset = file_offset;
+    return 0;
+}
+
+/* Writes buf, or zeroes if it is NULL. With fua set only the files this
+ * write went to are synced before it is acknowledged. */
+static int image_write(const void *buf, u_int32_t len, u_int64_t offset, int fua, void *userdata)
+{
+    vvfat_image_t *image = (vvfat_image_t*)userdata;
+    pthread_mutex_lock(&image_lock);
+    if (continuous_sync) {
+        if (!image->is_modified())
+            clock_gettime(CLOCK_MONOTONIC, &first_write);
+        clock_gettime(CLOCK_MONOTONIC, &last_write);
+    }
+    image->lseek(offset, SEEK_SET);
+    int ret = buf ? image->write(buf, len) : image->write_zeroes(len);
+    if ((ret >= 0) && fua)
+        ret = image->flush_last_write();
+    pthread_mutex_unlock(&image_lock);
 
     if (ret < 0) {
         return ret;
@@ -56,59 +122,279 @@ static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *use
     return 0;
 }
 
+static int xmp_write(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    return image_write(buf, len, offset, 0, userdata);
+}
+
+static int xmp_write_fua(const void *buf, u_int32_t len, u_int64_t offset, void *userdata)
+{
+    return image_write(buf, len, offset, 1, userdata);
+}
+
+static int xmp_write_zeroes(u_int64_t from, u_int32_t len, int fua, void *userdata)
+{
+    return image_write(NULL, len, from, fua, userdata);
+}
+
+/* Guest readahead: let the host start reading the files behind the range. */
+static int xmp_cache(u_int64_t from, u_int32_t len, void *userdata)
+{
+    vvfat_image_t *image = (vvfat_image_t*)userdata;
+    pthread_mutex_lock(&image_lock);
+    image->lseek(from, SEEK_SET);
+    int ret = image->prefetch(len);
+    pthread_mutex_unlock(&image_lock);
+
+    return ret;
+}
+
+#define XMP_MAX_EXTENTS 512
+
+/* Unallocated clusters and free directory space read as zeros. */
+static int xmp_block_status(u_int64_t from, u_int32_t len, struct buse_extent *extents,
+                            int max, void *userdata)
+{
+    vvfat_extent_t found[XMP_MAX_EXTENTS];
+
+    vvfat_image_t *image = (vvfat_image_t*)userdata;
+    if (max > XMP_MAX_EXTENTS)
+        max = XMP_MAX_EXTENTS;
+    pthread_mutex_lock(&image_lock);
+    image->lseek(from, SEEK_SET);
+    int n = image->get_extents(len, found, max);
+    pthread_mutex_unlock(&image_lock);
+
+    for (int i = 0; i < n; i++) {
+        extents[i].length = found[i].length;
+        extents[i].flags = found[i].hole ? (NBD_STATE_HOLE | NBD_STATE_ZERO) : 0;
+    }
+    return n;
+}
+
 static void xmp_disc(void *userdata)
 {
-  fprintf(stderr, "Received a disconnect request.\n");
+  buse_log(BUSE_LOG_INFO, "Received a disconnect request.\n");
   vvfat_image_t *image = (vvfat_image_t*)userdata;
+  pthread_mutex_lock(&image_lock);
   image->commit_changes();
+  pthread_mutex_unlock(&image_lock);
 }
 
+/* A flush only has to make the redolog durable; the host directory is
+ * updated by the committer thread. */
 static int xmp_flush(void *userdata)
 {
-    fprintf(stderr, "Received a flush request.\n");
-
     vvfat_image_t *image = (vvfat_image_t*)userdata;
-    image->commit_changes();
+    pthread_mutex_lock(&image_lock);
+    int ret = image->flush();
+    pthread_mutex_unlock(&image_lock);
 
-    return 0;
+    return ret;
 }
 
 static int xmp_trim(u_int64_t from, u_int32_t len, void *userdata)
 {
+  (void)(from);
+  (void)(len);
   (void)(userdata);
-  fprintf(stderr, "T - %lu, %u\n", from, len);
   return 0;
 }
 
 
+/* Writes changes back to the host directory every commit_interval seconds
+ * (if anything was written), and whenever SIGUSR1 is received. Only the
+ * directories the guest wrote to are read back, so committing often is
+ * cheap. */
+static void *xmp_committer(void *userdata)
+{
+  vvfat_image_t *image = (vvfat_image_t*)userdata;
+  sigset_t set;
+  struct timespec timeout;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (continuous_sync) {
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = SYNC_POLL_MS * 1000000L;
+  } else {
+    timeout.tv_sec = commit_interval;
+    timeout.tv_nsec = 0;
+  }
+
+  while (!committer_stop) {
+    if (continuous_sync || (commit_interval > 0))
+      sig = sigtimedwait(&set, NULL, &timeout);
+    else
+      sig = sigwaitinfo(&set, NULL);
+    if (committer_stop)
+      break;
+    if ((sig < 0) && (errno != EAGAIN))
+      continue;
+
+    pthread_mutex_lock(&image_lock);
+    if (continuous_sync && (sig != SIGUSR1) && image->is_modified() &&
+        (elapsed_ms(&last_write) < SYNC_IDLE_MS) &&
+        (elapsed_ms(&first_write) < SYNC_MAX_LAG_MS)) {
+      pthread_mutex_unlock(&image_lock);
+      continue;
+    }
+    if ((sig == SIGUSR1) || image->is_modified()) {
+      buse_log(BUSE_LOG_INFO, "Committing changes to host directory.\n");
+      image->commit_changes();
+    }
+    pthread_mutex_unlock(&image_lock);
+  }
+  return NULL;
+}
+
+/* only there to interrupt buse_serve() and buse_ublk() */
+static void xmp_stop(int sig)
+{
+  (void)(sig);
+}
+
 static struct buse_operations aop = {
   .read = xmp_read,
   .write = xmp_write,
   .disc = xmp_disc,
   .flush = xmp_flush,
   .trim = xmp_trim,
+  .read_fd = xmp_read_fd,
+  .write_fua = xmp_write_fua,
+  .write_zeroes = xmp_write_zeroes,
+  .cache = xmp_cache,
+  .block_status = xmp_block_status,
   .size = 528482304,
+  .flags = 0,  /* not rotational, the host files may be on anything */
+  .block_size = 0,  /* -b, otherwise taken from the image once it is open */
 };
   //.size = 1024 * 1024 * 1024,
 
 int main(int argc, char *argv[])
 {
-  if (argc != 3)
+  sigset_t set;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:swHvql:u:b:d:")) != -1) {
+    switch (opt) {
+      case 'i':
+        commit_interval = atoi(optarg);
+        break;
+      case 's':
+        continuous_sync = 1;
+        break;
+      case 'w':
+        write_through = 1;
+        break;
+      case 'H':
+        buse_use_hugepages = 1;
+        break;
+      case 'v':
+        buse_log_level++;
+        break;
+      case 'q':
+        buse_log_level = BUSE_LOG_WARN;
+        break;
+      case 'l':
+        listen_address = optarg;
+        break;
+      case 'u':
+        ublk_queues = atoi(optarg);
+        if (ublk_queues < 1)
+          argc = 0;
+        break;
+      case 'b':
+        aop.block_size = atoi(optarg);
+        if ((aop.block_size != 512) && (aop.block_size != 4096))
+          argc = 0;
+        break;
+      case 'd':
+        lazy_depth = atoi(optarg);
+        if (lazy_depth < 1)
+          argc = 0;
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+  if (argc - optind != ((listen_address || ublk_queues) ? 1 : 2))
   {
     fprintf(stderr, 
         "Usage:\n"
-        "  %s /dev/nbd0 /export/ums\n"
-        "Don't forget to load nbd kernel module (`modprobe nbd`) and\n"
-        "run example from root.\n", argv[0]);
+        "  %s [-i seconds | -s] [-w] [-H] [-b 512|4096] [-d levels] [-v | -q] /dev/nbd0 /export/ums\n"
+        "  %s [options] -l unix:/run/ums.sock|host:port /export/ums\n"
+        "  %s [options] -u queues /export/ums\n"
+        "Changes are written back to the directory every `-i' seconds\n"
+        "(default 5, 0 disables), on SIGUSR1 and on disconnect.\n"
+        "With `-s' they are written back as soon as the guest pauses\n"
+        "writing, at most about a second after they were made.\n"
+        "With `-w' in-place writes to existing files go to the host\n"
+        "file immediately.\n"
+        "`-H' backs large request buffers with huge pages.\n"
+        "`-b 4096' makes a 4Kn disk, 4096 byte logical sectors throughout.\n"
+        "With `-d' only that many directory levels are read at startup,\n"
+        "deeper subtrees when the client first looks at them. Counting\n"
+        "the free space reads the whole FAT and with it every subtree;\n"
+        "Linux does that on every statfs() unless mounted with `usefree'.\n"
+        "`-v' logs more (twice: trace every request), `-q' only warnings.\n"
+        "With `-l' the image is served to NBD clients on a unix or TCP\n"
+        "socket until SIGINT or SIGTERM, no nbd device is needed.\n"
+        "With `-u' it is a ublk device (/dev/ublkbN, module `ublk_drv')\n"
+        "with that many queues, until SIGINT or SIGTERM.\n"
+        "Otherwise don't forget to load nbd kernel module (`modprobe nbd`)\n"
+        "and run example from root.\n", argv[0], argv[0], argv[0]);
     return 1;
   }
+  const char *directory = argv[argc - 1];
   vvfat_image_t image(aop.size, "zg");
-  if (image.open(argv[2]) != 0) {
-      fprintf(stderr, "Failed to open directory %s\n", argv[2]);
+  image.set_write_through(write_through);
+  image.set_lazy_depth(lazy_depth);
+  if (aop.block_size)
+    image.set_sector_size(aop.block_size);
+  if (image.open(directory) != 0) {
+      fprintf(stderr, "Failed to open directory %s\n", directory);
       return 1;
   }
+  /* what NBD_INFO_BLOCK_SIZE and the ublk parameters advertise */
+  aop.block_size = image.get_sector_size();
+
+  /* SIGUSR1 is only ever consumed by the committer thread, SIGINT and
+   * SIGTERM only by this one, where they stop buse_serve() or buse_ublk() */
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (listen_address || ublk_queues) {
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+  }
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  pthread_create(&committer, NULL, xmp_committer, (void *)&image);
+  buse_trace_start();
+
+  int ret;
+  if (listen_address || ublk_queues) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = xmp_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigdelset(&set, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    if (listen_address)
+      ret = buse_serve(listen_address, &aop, (void *)&image);
+    else
+      ret = buse_ublk(ublk_queues, &aop, (void *)&image);
+  } else {
+    ret = buse_main(argv[optind], &aop, (void *)&image);
+  }
 
-  int ret = buse_main(argv[1], &aop, (void *)&image);
+  committer_stop = 1;
+  pthread_kill(committer, SIGUSR1);
+  pthread_join(committer, NULL);
   image.close();
+  buse_trace_stop();
   return ret;
 }
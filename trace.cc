@@ -0,0 +1,221 @@
+/*
+ * trace - leveled logging and request tracing for buse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+int buse_log_level = BUSE_LOG_INFO;
+
+static const char *level_names[] = { "error", "warning", "info", "debug", "trace" };
+
+static const char *event_formats[TRACE_EVENTS] = {
+  "nbd read offset=%llu len=%llu",
+  "nbd write offset=%llu len=%llu",
+  "nbd flush",
+  "nbd trim offset=%llu len=%llu",
+  "nbd write zeroes offset=%llu len=%llu",
+  "nbd cache offset=%llu len=%llu",
+  "nbd block status offset=%llu len=%llu",
+  "read offset=%llu len=%llu (sendfile)",
+  "vvfat write sector=%llu left=%llu",
+  "vvfat write through sector=%llu left=%llu",
+  "redolog read extent=%llu offset=%#llx",
+  "redolog read extent=%llu block=%llu not in redolog",
+  "redolog write extent=%llu offset=%#llx",
+};
+
+/* Every thread that traces owns a ring only it writes to; the drain thread
+ * is the only reader. head and tail count records, so the ring is full when
+ * they are TRACE_RING_SIZE apart. Records that don't fit are dropped. When
+ * the thread exits its ring is marked dead, and the drain thread frees it
+ * once it is empty. */
+#define TRACE_RING_SIZE 8192
+#define TRACE_DRAIN_MS  100
+
+struct trace_rec {
+  u_int64_t ns;
+  u_int32_t event;
+  u_int32_t pad;
+  u_int64_t a, b;
+};
+
+struct trace_ring {
+  struct trace_rec recs[TRACE_RING_SIZE];
+  unsigned head;
+  unsigned tail;
+  unsigned long dropped;       /* written by the owner only */
+  unsigned long dropped_seen;  /* ... and what the drain thread reported */
+  pid_t tid;
+  int dead;
+  struct trace_ring *next;
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static __thread struct trace_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t drainer;
+static int drainer_running = 0;
+static volatile int drainer_stop = 0;
+
+void buse_log_printf(int level, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (level < BUSE_LOG_INFO)
+    fprintf(stderr, "%s: ", level_names[level]);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+static void ring_exit(void *ring)
+{
+  __atomic_store_n(&((struct trace_ring *)ring)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+  pthread_key_create(&ring_key, ring_exit);
+}
+
+static struct trace_ring *ring_register(void)
+{
+  struct trace_ring *ring = (struct trace_ring *)calloc(1, sizeof(*ring));
+
+  if (ring == NULL)
+    return NULL;
+  ring->tid = (pid_t)syscall(SYS_gettid);
+  pthread_once(&ring_key_once, ring_key_create);
+  pthread_setspecific(ring_key, ring);
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  return my_ring = ring;
+}
+
+void buse_trace_record(int event, u_int64_t a, u_int64_t b)
+{
+  struct trace_ring *ring = my_ring;
+  struct trace_rec *rec;
+  struct timespec now;
+  unsigned head;
+
+  if (ring == NULL && (ring = ring_register()) == NULL)
+    return;
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rec = &ring->recs[head & (TRACE_RING_SIZE - 1)];
+  rec->ns = (u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  rec->event = event;
+  rec->a = a;
+  rec->b = b;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void drain_rings(FILE *out)
+{
+  struct trace_ring *ring, *next, **link;
+  struct trace_rec *rec;
+  unsigned long dropped;
+  unsigned head, tail;
+  int dead;
+
+  pthread_mutex_lock(&rings_lock);
+  ring = rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  for (; ring != NULL; ring = next) {
+    next = ring->next;
+    /* a dead ring gets no more records, what head says now is all */
+    dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (tail = ring->tail; tail != head; tail++) {
+      rec = &ring->recs[tail & (TRACE_RING_SIZE - 1)];
+      fprintf(out, "%llu.%06llu [%d] ", (unsigned long long)(rec->ns / 1000000000),
+              (unsigned long long)(rec->ns % 1000000000 / 1000), (int)ring->tid);
+      fprintf(out, event_formats[rec->event],
+              (unsigned long long)rec->a, (unsigned long long)rec->b);
+      fputc('\n', out);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_seen) {
+      fprintf(out, "[%d] %lu trace records dropped\n", (int)ring->tid,
+              dropped - ring->dropped_seen);
+      ring->dropped_seen = dropped;
+    }
+    if (dead) {
+      /* only this thread unlinks, new rings are only put in front */
+      pthread_mutex_lock(&rings_lock);
+      for (link = &rings; *link != ring; link = &(*link)->next)
+        ;
+      *link = next;
+      pthread_mutex_unlock(&rings_lock);
+      free(ring);
+    }
+  }
+  fflush(out);
+}
+
+static void *drain_thread(void *unused)
+{
+  struct timespec delay = { 0, TRACE_DRAIN_MS * 1000000L };
+
+  (void)unused;
+  while (!drainer_stop) {
+    nanosleep(&delay, NULL);
+    drain_rings(stderr);
+  }
+  return NULL;
+}
+
+int buse_trace_start(void)
+{
+  if (BUSE_LOG_TRACE > BUSE_LOG_MAX || buse_log_level < BUSE_LOG_TRACE ||
+      drainer_running)
+    return 0;
+  if (pthread_create(&drainer, NULL, drain_thread, NULL) != 0)
+    return -1;
+  drainer_running = 1;
+  return 0;
+}
+
+void buse_trace_stop(void)
+{
+  if (!drainer_running)
+    return;
+  drainer_stop = 1;
+  pthread_join(drainer, NULL);
+  drainer_running = 0;
+  drain_rings(stderr);
+}
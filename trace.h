@@ -0,0 +1,71 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+  /* Log levels, most severe first. A message is printed if its level is at
+   * most buse_log_level; anything above BUSE_LOG_MAX is compiled out. */
+  enum {
+    BUSE_LOG_ERROR = 0,
+    BUSE_LOG_WARN,
+    BUSE_LOG_INFO,
+    BUSE_LOG_DEBUG,
+    BUSE_LOG_TRACE,
+  };
+
+#ifndef BUSE_LOG_MAX
+#define BUSE_LOG_MAX BUSE_LOG_TRACE
+#endif
+
+  extern int buse_log_level;
+
+  /* Trace points on the request path. They log binary records (timestamp,
+   * event, two arguments) and leave the formatting to the drain thread, see
+   * buse_trace_start(). */
+  enum {
+    TRACE_NBD_READ = 0,         /* offset, length */
+    TRACE_NBD_WRITE,            /* offset, length */
+    TRACE_NBD_FLUSH,
+    TRACE_NBD_TRIM,             /* offset, length */
+    TRACE_NBD_WRITE_ZEROES,     /* offset, length */
+    TRACE_NBD_CACHE,            /* offset, length */
+    TRACE_NBD_BLOCK_STATUS,     /* offset, length */
+    TRACE_READ_FD,              /* offset, length */
+    TRACE_VVFAT_WRITE,          /* sector, sectors left */
+    TRACE_VVFAT_WRITE_THROUGH,  /* sector, sectors left */
+    TRACE_REDOLOG_READ,         /* extent, block offset */
+    TRACE_REDOLOG_MISS,         /* extent, block in extent */
+    TRACE_REDOLOG_WRITE,        /* extent, block offset */
+    TRACE_EVENTS
+  };
+
+  void buse_log_printf(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+  void buse_trace_record(int event, u_int64_t a, u_int64_t b);
+
+  /* Starts the thread that formats trace records, if buse_log_level asks for
+   * them; buse_trace_stop() prints what is left and stops it. */
+  int buse_trace_start(void);
+  void buse_trace_stop(void);
+
+#define buse_log(level, ...) \
+  do { \
+    if ((level) <= BUSE_LOG_MAX && (level) <= buse_log_level) \
+      buse_log_printf((level), __VA_ARGS__); \
+  } while (0)
+
+#define buse_trace(event, a, b) \
+  do { \
+    if (BUSE_LOG_TRACE <= BUSE_LOG_MAX && buse_log_level >= BUSE_LOG_TRACE) \
+      buse_trace_record((event), (u_int64_t)(a), (u_int64_t)(b)); \
+  } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H_INCLUDED */
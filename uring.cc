@@ -0,0 +1,108 @@
+/*
+ * uring - a minimal io_uring on the raw syscalls
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#ifdef BUSE_IO_URING
+int uring_setup(struct uring *ring, unsigned entries, unsigned flags)
+{
+  struct io_uring_params p;
+  size_t cq_size;
+  char *ptr;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = flags;
+  ring->sqe_shift = (flags & IORING_SETUP_SQE128) ? 1 : 0;
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_FAST_POLL) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(ring->fd);
+    return -1;
+  }
+  ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > ring->ring_size)
+    ring->ring_size = cq_size;
+  ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring_ptr == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  ring->sqes_size = (p.sq_entries * sizeof(struct io_uring_sqe)) << ring->sqe_shift;
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+    return -1;
+  }
+  ptr = (char*)ring->ring_ptr;
+  ring->sq_head = (unsigned*)(ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(ptr + p.sq_off.array);
+  ring->cq_head = (unsigned*)(ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(ptr + p.cq_off.cqes);
+  ring->sq_entries = p.sq_entries;
+  ring->to_submit = 0;
+  return 0;
+}
+
+void uring_close(struct uring *ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->ring_ptr, ring->ring_size);
+  close(ring->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index << ring->sqe_shift];
+
+  memset(sqe, 0, sizeof(*sqe) << ring->sqe_shift);
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  return sqe;
+}
+
+int uring_enter(struct uring *ring, unsigned min_complete)
+{
+  int ret;
+
+  ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (ret >= 0) {
+    ring->to_submit -= ret;
+  } else if (errno == EINTR) {
+    ret = 0;
+  }
+  return ret;
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/syscall.h>
+
+  /* A minimal io_uring on the raw syscalls, shared by the nbd and ublk loops
+   * in buse.cc and the directory scan in vvfat.cc. BUSE_IO_URING is only
+   * defined when the headers know about it. */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define BUSE_IO_URING
+#endif
+#endif
+
+#ifdef BUSE_IO_URING
+  struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, to_submit, sqe_shift;
+    void *ring_ptr;
+    size_t ring_size, sqes_size;
+  };
+
+  /* flags are IORING_SETUP_*, with IORING_SETUP_SQE128 every sqe takes two
+   * slots of the array. Fails on kernels without IORING_FEAT_FAST_POLL
+   * (5.7). */
+  int uring_setup(struct uring *ring, unsigned entries, unsigned flags);
+  void uring_close(struct uring *ring);
+
+  /* Callers never have more requests outstanding than the ring has entries,
+   * it can't fill up. */
+  struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+  /* Submits what uring_get_sqe() queued and waits for min_complete
+   * completions; EINTR counts as nothing submitted. */
+  int uring_enter(struct uring *ring, unsigned min_complete);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* URING_H_INCLUDED */
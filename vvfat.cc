@@ -52,17 +52,24 @@
 #include <errno.h>
 #include <time.h>
 #include <stropts.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //#include "iodev.h"
 //#include "hdimage.h"
 #include "vvfat.h"
+#include "trace.h"
+#include "uring.h"
 
 #define LOG_THIS bx_devices.pluginHDImageCtl->
 
 #define VVFAT_MBR  "vvfat_mbr.bin"
 #define VVFAT_BOOT "vvfat_boot.bin"
 #define VVFAT_ATTR "vvfat_attr.cfg"
+#define VVFAT_LAZY "vvfat_lazy.cfg"
 
 int hdimage_open_file(const char *pathname, int flags, Bit64u *fsize, time_t *mtime)
 {
@@ -151,14 +158,19 @@ bx_bool hdimage_backup_file(int fd, const char *backup_fname)
 
 static int vvfat_count = 0;
 
+// sectors kept in vvfat_image_t::first_sectors
+#define VVFAT_FIRST_SECTORS 96
+
 redolog_t::redolog_t()
 {
   fd = -1;
   catalog = NULL;
-  bitmap = NULL;
+  bitmaps = NULL;
+  bitmaps_size = 0;
   extent_index = (Bit32u)0;
   extent_offset = (Bit32u)0;
   extent_next = (Bit32u)0;
+  block_size = 512;
 }
 
 void redolog_t::print_header()
@@ -203,7 +215,7 @@ int redolog_t::make_header(const char* type, Bit64u size)
 
   // Compute #entries and extent size values
   do {
-    extent_size = 8 * bitmap_size * 512;
+    extent_size = 8 * bitmap_size * block_size;
 
     header.specific.catalog = htod32(entries);
     header.specific.bitmap = htod32(bitmap_size);
@@ -223,16 +235,15 @@ int redolog_t::make_header(const char* type, Bit64u size)
   print_header();
 
   catalog = (Bit32u*)malloc(dtoh32(header.specific.catalog) * sizeof(Bit32u));
-  bitmap = (Bit8u*)malloc(dtoh32(header.specific.bitmap));
 
-  if ((catalog == NULL) || (bitmap==NULL))
-    printf("redolog : could not malloc catalog or bitmap\n");
+  if (catalog == NULL)
+    printf("redolog : could not malloc catalog\n");
 
   for (Bit32u i=0; i<dtoh32(header.specific.catalog); i++)
     catalog[i] = htod32(REDOLOG_PAGE_NOT_ALLOCATED);
 
-  bitmap_blocks = 1 + (dtoh32(header.specific.bitmap) - 1) / 512;
-  extent_blocks = 1 + (dtoh32(header.specific.extent) - 1) / 512;
+  bitmap_blocks = 1 + (dtoh32(header.specific.bitmap) - 1) / block_size;
+  extent_blocks = 1 + (dtoh32(header.specific.extent) - 1) / block_size;
 
   printf("redolog : each bitmap is %d blocks\n", bitmap_blocks);
   printf("redolog : each extent is %d blocks\n", extent_blocks);
@@ -285,6 +296,7 @@ int redolog_t::open(const char* filename, const char *type)
 int redolog_t::open(const char* filename, const char *type, int flags)
 {
   Bit64u imgsize = 0;
+  Bit64s bitmap_offset;
   time_t mtime;
 
   fd = hdimage_open_file(filename, flags, &imgsize, &mtime);
@@ -352,17 +364,41 @@ int redolog_t::open(const char* filename, const char *type, int flags)
   }
   printf("redolog : next extent will be at index %d\n",extent_next);
 
-  // memory used for storing bitmaps
-  bitmap = (Bit8u *)malloc(dtoh32(header.specific.bitmap));
+  // every bitmap bit stands for one block of the extent
+  block_size = dtoh32(header.specific.extent) / (8 * dtoh32(header.specific.bitmap));
+  if ((block_size < 512) || (block_size & (block_size - 1))) {
+    printf("redolog : bad block size %d\n", block_size);
+    return -1;
+  }
 
-  bitmap_blocks = 1 + (dtoh32(header.specific.bitmap) - 1) / 512;
-  extent_blocks = 1 + (dtoh32(header.specific.extent) - 1) / 512;
+  bitmap_blocks = 1 + (dtoh32(header.specific.bitmap) - 1) / block_size;
+  extent_blocks = 1 + (dtoh32(header.specific.extent) - 1) / block_size;
 
   printf("redolog : each bitmap is %d blocks\n", bitmap_blocks);
   printf("redolog : each extent is %d blocks\n", extent_blocks);
 
+  // the bitmaps are only ever read here, write() keeps them up to date
+  if (extent_next > 0) {
+    bitmaps = (Bit8u*)malloc((size_t)extent_next * dtoh32(header.specific.bitmap));
+    if (bitmaps == NULL) {
+      printf("redolog : could not malloc bitmaps\n");
+      return -1;
+    }
+    bitmaps_size = extent_next;
+  }
+  for (Bit32u i=0; i < dtoh32(header.specific.catalog); i++)
+  {
+    if (dtoh32(catalog[i]) == REDOLOG_PAGE_NOT_ALLOCATED)
+      continue;
+    bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
+    bitmap_offset += (Bit64s)block_size * dtoh32(catalog[i]) * (extent_blocks + bitmap_blocks);
+    if (bx_read_image(fd, (off_t)bitmap_offset, extent_bitmap(dtoh32(catalog[i])), dtoh32(header.specific.bitmap)) != (ssize_t)dtoh32(header.specific.bitmap)) {
+      printf("redolog : failed to read bitmap for extent %d\n", i);
+      return -1;
+    }
+  }
+
   imagepos = 0;
-  bitmap_update = 1;
 
   return 0;
 }
@@ -375,8 +411,13 @@ void redolog_t::close()
   if (catalog != NULL)
     free(catalog);
 
-  if (bitmap != NULL)
-    free(bitmap);
+  if (bitmaps != NULL)
+    free(bitmaps);
+}
+
+Bit8u* redolog_t::extent_bitmap(Bit32u extent)
+{
+  return bitmaps + (size_t)extent * dtoh32(header.specific.bitmap);
 }
 
 Bit64u redolog_t::get_size()
@@ -399,8 +440,8 @@ bx_bool redolog_t::set_timestamp(Bit32u timestamp)
 
 Bit64s redolog_t::lseek(Bit64s offset, int whence)
 {
-  if ((offset % 512) != 0) {
-    printf("redolog : lseek() offset not multiple of 512\n");
+  if ((offset % block_size) != 0) {
+    printf("redolog : lseek() offset not multiple of %d\n", block_size);
     return -1;
   }
   if (whence == SEEK_SET) {
@@ -416,12 +457,8 @@ Bit64s redolog_t::lseek(Bit64s offset, int whence)
     return -1;
   }
 
-  Bit32u old_extent_index = extent_index;
   extent_index = (Bit32u)(imagepos / dtoh32(header.specific.extent));
-  if (extent_index != old_extent_index) {
-    bitmap_update = 1;
-  }
-  extent_offset = (Bit32u)((imagepos % dtoh32(header.specific.extent)) / 512);
+  extent_offset = (Bit32u)((imagepos % dtoh32(header.specific.extent)) / block_size);
 
   //printf("redolog : lseeking extent index %d, offset %d\n",extent_index, extent_offset);
 
@@ -431,10 +468,11 @@ Bit64s redolog_t::lseek(Bit64s offset, int whence)
 ssize_t redolog_t::read(void* buf, size_t count)
 {
   Bit64s block_offset, bitmap_offset;
+  Bit8u *bitmap;
   ssize_t ret;
 
-  if (count != 512) {
-    printf("redolog : read() with count not 512\n");
+  if (count != block_size) {
+    printf("redolog : read() with count not %d\n", block_size);
     return -1;
   }
 
@@ -446,29 +484,21 @@ ssize_t redolog_t::read(void* buf, size_t count)
   }
 
   bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
-  bitmap_offset += (Bit64s)512 * dtoh32(catalog[extent_index]) * (extent_blocks + bitmap_blocks);
-  block_offset    = bitmap_offset + ((Bit64s)512 * (bitmap_blocks + extent_offset));
-
-  printf("redolog : bitmap offset is %x\n", (Bit32u)bitmap_offset);
-  printf("redolog : block offset is %x\n", (Bit32u)block_offset);
+  bitmap_offset += (Bit64s)block_size * dtoh32(catalog[extent_index]) * (extent_blocks + bitmap_blocks);
+  block_offset    = bitmap_offset + ((Bit64s)block_size * (bitmap_blocks + extent_offset));
 
-  if (bitmap_update) {
-    if (bx_read_image(fd, (off_t)bitmap_offset, bitmap,  dtoh32(header.specific.bitmap)) != (ssize_t)dtoh32(header.specific.bitmap)) {
-      printf("redolog : failed to read bitmap for extent %d\n", extent_index);
-      return -1;
-    }
-    bitmap_update = 0;
-  }
+  buse_trace(TRACE_REDOLOG_READ, extent_index, block_offset);
 
+  bitmap = extent_bitmap(dtoh32(catalog[extent_index]));
   if (((bitmap[extent_offset/8] >> (extent_offset%8)) & 0x01) == 0x00) {
-    printf("read not in redolog\n");
+    buse_trace(TRACE_REDOLOG_MISS, extent_index, extent_offset);
 
     // bitmap says block not in redolog
     return 0;
   }
 
   ret = bx_read_image(fd, (off_t)block_offset, buf, count);
-  if (ret >= 0) lseek(512, SEEK_CUR);
+  if (ret >= 0) lseek(block_size, SEEK_CUR);
 
   return ret;
 }
@@ -477,11 +507,12 @@ ssize_t redolog_t::write(const void* buf, size_t count)
 {
   Bit32u i;
   Bit64s block_offset, bitmap_offset, catalog_offset;
+  Bit8u *bitmap;
   ssize_t written;
   bx_bool update_catalog = 0;
 
-  if (count != 512) {
-    printf("redolog : write() with count not 512\n");
+  if (count != block_size) {
+    printf("redolog : write() with count not %d\n", block_size);
     return -1;
   }
 
@@ -493,26 +524,42 @@ ssize_t redolog_t::write(const void* buf, size_t count)
       return -1;
     }
 
-    printf("redolog : allocating new extent at %d\n", extent_next);
+    buse_log(BUSE_LOG_DEBUG, "redolog : allocating new extent at %d\n", extent_next);
+
+    if (extent_next >= bitmaps_size) {
+      Bit32u size = (bitmaps_size > 0) ? bitmaps_size * 2 : 64;
+      Bit8u *grown;
+
+      if (size > dtoh32(header.specific.catalog))
+        size = dtoh32(header.specific.catalog);
+      grown = (Bit8u*)realloc(bitmaps, (size_t)size * dtoh32(header.specific.bitmap));
+      if (grown == NULL) {
+        printf("redolog : could not malloc bitmaps\n");
+        return -1;
+      }
+      bitmaps = grown;
+      bitmaps_size = size;
+    }
+    memset(extent_bitmap(extent_next), 0, dtoh32(header.specific.bitmap));
 
     // Extent not allocated, allocate new
     catalog[extent_index] = htod32(extent_next);
 
     extent_next += 1;
 
-    char *zerobuffer = (char*)malloc(512);
-    memset(zerobuffer, 0, 512);
+    char *zerobuffer = (char*)malloc(block_size);
+    memset(zerobuffer, 0, block_size);
 
     // Write bitmap
     bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
-    bitmap_offset += (Bit64s)512 * dtoh32(catalog[extent_index]) * (extent_blocks + bitmap_blocks);
+    bitmap_offset += (Bit64s)block_size * dtoh32(catalog[extent_index]) * (extent_blocks + bitmap_blocks);
     ::lseek(fd, (off_t)bitmap_offset, SEEK_SET);
     for (i=0; i<bitmap_blocks; i++) {
-      ::write(fd, zerobuffer, 512);
+      ::write(fd, zerobuffer, block_size);
     }
     // Write extent
     for (i=0; i<extent_blocks; i++) {
-      ::write(fd, zerobuffer, 512);
+      ::write(fd, zerobuffer, block_size);
     }
 
     free(zerobuffer);
@@ -521,23 +568,16 @@ ssize_t redolog_t::write(const void* buf, size_t count)
   }
 
   bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
-  bitmap_offset += (Bit64s)512 * dtoh32(catalog[extent_index]) * (extent_blocks + bitmap_blocks);
-  block_offset    = bitmap_offset + ((Bit64s)512 * (bitmap_blocks + extent_offset));
+  bitmap_offset += (Bit64s)block_size * dtoh32(catalog[extent_index]) * (extent_blocks + bitmap_blocks);
+  block_offset    = bitmap_offset + ((Bit64s)block_size * (bitmap_blocks + extent_offset));
 
-  printf("redolog : bitmap offset is %x\n", (Bit32u)bitmap_offset);
-  printf("redolog : block offset is %x\n", (Bit32u)block_offset);
+  buse_trace(TRACE_REDOLOG_WRITE, extent_index, block_offset);
 
   // Write block
   written = bx_write_image(fd, (off_t)block_offset, (void*)buf, count);
 
   // Write bitmap
-  if (bitmap_update) {
-    if (bx_read_image(fd, (off_t)bitmap_offset, bitmap,  dtoh32(header.specific.bitmap)) != (ssize_t)dtoh32(header.specific.bitmap)) {
-      printf("redolog : failed to read bitmap for extent %d\n", extent_index);
-      return 0;
-    }
-    bitmap_update = 0;
-  }
+  bitmap = extent_bitmap(dtoh32(catalog[extent_index]));
 
   // If bloc does not belong to extent yet
   if (((bitmap[extent_offset/8] >> (extent_offset%8)) & 0x01) == 0x00) {
@@ -550,16 +590,52 @@ ssize_t redolog_t::write(const void* buf, size_t count)
     // FIXME if mmap
     catalog_offset  = (Bit64s)STANDARD_HEADER_SIZE + (extent_index * sizeof(Bit32u));
 
-    printf("redolog : writing catalog at offset %x\n", (Bit32u)catalog_offset);
+    buse_log(BUSE_LOG_DEBUG, "redolog : writing catalog at offset %x\n", (Bit32u)catalog_offset);
 
     bx_write_image(fd, (off_t)catalog_offset, &catalog[extent_index], sizeof(Bit32u));
   }
 
-  if (written >= 0) lseek(512, SEEK_CUR);
+  if (written >= 0) lseek(block_size, SEEK_CUR);
 
   return written;
 }
 
+// returns 1 if any block of the range was written to the redolog
+bx_bool redolog_t::contains(Bit64s offset, Bit64s count)
+{
+  Bit32u extent_size = dtoh32(header.specific.extent);
+  Bit32u index, block, last;
+  Bit64s done;
+  Bit8u *map;
+
+  while (count > 0) {
+    index = (Bit32u)(offset / extent_size);
+    block = (Bit32u)((offset % extent_size) / block_size);
+    last = block + (Bit32u)((count + block_size - 1) / block_size);
+    if (last > extent_blocks)
+      last = extent_blocks;
+    if (dtoh32(catalog[index]) != REDOLOG_PAGE_NOT_ALLOCATED) {
+      map = extent_bitmap(dtoh32(catalog[index]));
+      for (; block < last; block++) {
+        if ((map[block / 8] >> (block % 8)) & 0x01)
+          return 1;
+      }
+    }
+    done = (Bit64s)last * block_size - (offset % extent_size);
+    offset += done;
+    count -= done;
+  }
+  return 0;
+}
+
+int redolog_t::sync()
+{
+  // header, catalog, bitmaps and extents all live in the same file
+  if (fd < 0)
+    return 0;
+  return fdatasync(fd);
+}
+
 int redolog_t::check_format(int fd, const char *subtype)
 {
   redolog_header_t temp_header;
@@ -592,7 +668,7 @@ int redolog_t::commit(device_image_t *base_image)
 {
   int ret = 0;
   Bit32u i;
-  Bit8u buffer[512];
+  Bit8u *buffer = (Bit8u*)malloc(block_size);
 
   printf("\nCommitting changes to base image file: [  0%%]\n");
 
@@ -602,17 +678,11 @@ int redolog_t::commit(device_image_t *base_image)
 
     if (dtoh32(catalog[i]) != REDOLOG_PAGE_NOT_ALLOCATED) {
       Bit64s bitmap_offset;
-      Bit32u bitmap_size, j;
+      Bit8u *bitmap = extent_bitmap(dtoh32(catalog[i]));
+      Bit32u j;
 
       bitmap_offset  = (Bit64s)STANDARD_HEADER_SIZE + (dtoh32(header.specific.catalog) * sizeof(Bit32u));
-      bitmap_offset += (Bit64s)512 * dtoh32(catalog[i]) * (extent_blocks + bitmap_blocks);
-
-      // Read bitmap
-      bitmap_size = dtoh32(header.specific.bitmap);
-      if ((Bit32u)bx_read_image(fd, (off_t)bitmap_offset, bitmap, bitmap_size) != bitmap_size) {
-        ret = -1;
-        break;
-      }
+      bitmap_offset += (Bit64s)block_size * dtoh32(catalog[i]) * (extent_blocks + bitmap_blocks);
 
       for (j = 0; j < dtoh32(header.specific.bitmap); j++) {
         Bit32u bit;
@@ -621,21 +691,21 @@ int redolog_t::commit(device_image_t *base_image)
           if ( (bitmap[j] & (1 << bit)) != 0) {
             Bit64s base_offset, block_offset;
 
-            block_offset = bitmap_offset + ((Bit64s)512 * (bitmap_blocks + ((j * 8) + bit)));
+            block_offset = bitmap_offset + ((Bit64s)block_size * (bitmap_blocks + ((j * 8) + bit)));
 
-            if (bx_read_image(fd, (off_t)block_offset, buffer, 512) != 512) {
+            if (bx_read_image(fd, (off_t)block_offset, buffer, block_size) != (ssize_t)block_size) {
               ret = -1;
               break;
             }
 
             base_offset  = (Bit64s)i * (dtoh32(header.specific.extent));
-            base_offset += (Bit64s)512 * ((j * 8) + bit);
+            base_offset += (Bit64s)block_size * ((j * 8) + bit);
 
             if (base_image->lseek(base_offset, SEEK_SET) < 0) {
               ret = -1;
               break;
             }
-            if (base_image->write(buffer, 512) < 0) {
+            if (base_image->write(buffer, block_size) < 0) {
               ret = -1;
               break;
             }
@@ -644,6 +714,7 @@ int redolog_t::commit(device_image_t *base_image)
       }
     }
   }
+  free(buffer);
   return ret;
 }
 #endif
@@ -655,16 +726,148 @@ bx_bool redolog_t::save_state(const char *backup_fname)
 }
 #endif
 
+// localtime_r() takes the libc timezone lock on every call. The UTC offset
+// only changes at DST (or rule) transitions, so each thread remembers the
+// periods it has seen with their offset, sorted by start, and does the
+// calendar itself.
+#define TZ_PERIODS     256 // more than a century of DST, dropped when full
+#define TZ_PROBE_STEP  86400 // Ramadan pauses DST for weeks, keep well below
+#define TZ_PROBE_RANGE (366 * 86400)
+#define TZ_TIME_LIMIT  ((time_t)1 << 40)
+
+typedef struct {
+  time_t start, end; // offset holds for start <= time < end
+  long offset;
+} tz_period_t;
+
+static __thread tz_period_t tz_periods[TZ_PERIODS];
+static __thread unsigned tz_count, tz_last;
+
+static bx_bool tz_offset_at(time_t time, long *offset)
+{
+  struct tm t;
+
+  if (localtime_r(&time, &t) == NULL)
+    return 0;
+  *offset = t.tm_gmtoff;
+  return 1;
+}
+
+// walks from time in steps of dir * TZ_PROBE_STEP and returns the last
+// second before the offset changes, or time + dir * TZ_PROBE_RANGE
+static bx_bool tz_period_edge(time_t time, long offset, int dir, time_t *edge)
+{
+  time_t same = time, other, mid;
+  long o;
+
+  while ((same - time) * dir < TZ_PROBE_RANGE) {
+    other = same + dir * TZ_PROBE_STEP;
+    if (!tz_offset_at(other, &o))
+      return 0;
+    if (o != offset) {
+      while ((other - same) * dir > 1) {
+        mid = same + (other - same) / 2;
+        if (!tz_offset_at(mid, &o))
+          return 0;
+        if (o == offset)
+          same = mid;
+        else
+          other = mid;
+      }
+      *edge = same;
+      return 1;
+    }
+    same = other;
+  }
+  *edge = time + dir * TZ_PROBE_RANGE;
+  return 1;
+}
+
+static const tz_period_t *tz_period(time_t time)
+{
+  tz_period_t *period = &tz_periods[tz_last];
+  unsigned lo = 0, hi = tz_count, mid;
+  time_t first, last;
+  long offset;
+
+  if (tz_count > 0 && time >= period->start && time < period->end)
+    return period;
+  // the first period that ends after time
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (tz_periods[mid].end <= time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < tz_count && time >= tz_periods[lo].start) {
+    tz_last = lo;
+    return &tz_periods[lo];
+  }
+  if (time <= -TZ_TIME_LIMIT || time >= TZ_TIME_LIMIT ||
+      !tz_offset_at(time, &offset) ||
+      !tz_period_edge(time, offset, -1, &first) ||
+      !tz_period_edge(time, offset, 1, &last))
+    return NULL;
+  if (tz_count == TZ_PERIODS)
+    tz_count = lo = 0;
+  // periods cut short by TZ_PROBE_RANGE may overlap, but then both their
+  // starts and ends are in the same order
+  memmove(&tz_periods[lo + 1], &tz_periods[lo], (tz_count - lo) * sizeof(tz_period_t));
+  tz_count++;
+  period = &tz_periods[lo];
+  period->start = first;
+  period->end = last + 1;
+  period->offset = offset;
+  tz_last = lo;
+  return period;
+}
+
+void fat_datetimes(const time_t *stamps, int count, Bit16u *dates, Bit16u *times)
+{
+  const tz_period_t *period;
+  Bit64s local, days, secs, era, year;
+  unsigned doe, yoe, doy, mp, mday, mon;
+  struct tm t;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    period = tz_period(stamps[i]);
+    if (period == NULL) {
+      localtime_r(&stamps[i], &t);
+      times[i] = htod16((t.tm_sec/2) | (t.tm_min<<5) | (t.tm_hour<<11));
+      dates[i] = htod16((t.tm_mday) | ((t.tm_mon+1)<<5) | ((t.tm_year-80)<<9));
+      continue;
+    }
+    local = (Bit64s)stamps[i] + period->offset;
+    days = local / 86400;
+    secs = local % 86400;
+    if (secs < 0) {
+      secs += 86400;
+      days--;
+    }
+    // civil date of a day count since 1970-01-01 (proleptic Gregorian,
+    // years counted from March so the leap day comes last)
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = (unsigned)(days - era * 146097);
+    yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    doy = doe - (365*yoe + yoe/4 - yoe/100);
+    mp = (5*doy + 2) / 153;
+    mday = doy - (153*mp + 2)/5 + 1;
+    mon = mp < 10 ? mp + 3 : mp - 9;
+    year = yoe + era * 400 + (mon <= 2);
+    times[i] = htod16((secs%60/2) | (secs/60%60<<5) | (secs/3600<<11));
+    dates[i] = htod16(mday | (mon<<5) | ((int)(year-1980)<<9));
+  }
+}
+
 Bit16u fat_datetime(time_t time, int return_time)
 {
-  struct tm* t;
-  struct tm t1;
+  Bit16u date, t;
 
-  t = &t1;
-  localtime_r(&time, t);
-  if (return_time)
-    return htod16((t->tm_sec/2) | (t->tm_min<<5) | (t->tm_hour<<11));
-  return htod16((t->tm_mday) | ((t->tm_mon+1)<<5) | ((t->tm_year-80)<<9));
+  fat_datetimes(&time, 1, &date, &t);
+  return return_time ? t : date;
 }
 
 // portable mkdir / rmdir
@@ -701,17 +904,33 @@ static inline void* array_get(array_t* array,unsigned int index)
   return array->pointer + index * array->item_size;
 }
 
+// grows the allocation to at least size bytes, by half of what it has at
+// least, so that filling an array item by item copies it O(1) times per item
+static inline int array_grow(array_t* array, unsigned int size)
+{
+  unsigned int new_size = array->size + array->size / 2;
+  char *pointer;
+
+  if (size <= array->size)
+    return 0;
+  if (new_size < size)
+    new_size = size + 31 * array->item_size;
+  pointer = (char*)realloc(array->pointer, new_size);
+  if (!pointer)
+    return -1;
+  array->pointer = pointer;
+  memset(array->pointer + array->size, 0, new_size - array->size);
+  array->size = new_size;
+  return 0;
+}
+
+// makes index a valid item, the new items are zeroed
 static inline int array_ensure_allocated(array_t* array, int index)
 {
-  if ((index + 1) * array->item_size > array->size) {
-    int new_size = (index + 32) * array->item_size;
-    array->pointer = (char*)realloc(array->pointer, new_size);
-    if (!array->pointer)
-      return -1;
-    memset(array->pointer + array->size, 0, new_size - array->size);
-    array->size = new_size;
+  if (array_grow(array, (index + 1) * array->item_size) < 0)
+    return -1;
+  if ((unsigned int)index >= array->next)
     array->next = index + 1;
-  }
   return 0;
 }
 
@@ -731,13 +950,8 @@ static inline void* array_get_next(array_t* array)
 
 static inline void* array_insert(array_t* array,unsigned int index,unsigned int count)
 {
-  if ((array->next+count)*array->item_size > array->size) {
-    int increment = count*array->item_size;
-    array->pointer = (char*)realloc(array->pointer, array->size+increment);
-    if (!array->pointer)
-      return NULL;
-    array->size += increment;
-  }
+  if (array_grow(array, (array->next + count) * array->item_size) < 0)
+    return NULL;
   memmove(array->pointer+(index+count)*array->item_size,
           array->pointer+index*array->item_size,
           (array->next-index)*array->item_size);
@@ -780,6 +994,356 @@ static inline int array_roll(array_t* array, int index_to, int index_from, int c
   return 0;
 }
 
+// mappings per entry of vvfat_image_t::mapping_begin_top
+#define MAPPING_INDEX_STRIDE 16
+
+// name arena functions; blocks are never moved, so the strings stay put
+#define NAME_ARENA_BLOCK 0x10000
+
+static inline void name_arena_init(name_arena_t* arena)
+{
+  arena->block = NULL;
+  arena->used = arena->size = 0;
+}
+
+static const char* name_arena_strdup(name_arena_t* arena, const char* name)
+{
+  size_t len = strlen(name) + 1;
+  char *copy;
+
+  if (arena->used + len > arena->size) {
+    size_t size = sizeof(char*) + len;
+    if (size < NAME_ARENA_BLOCK)
+      size = NAME_ARENA_BLOCK;
+    char *block = (char*)malloc(size);
+    *(char**)block = arena->block;
+    arena->block = block;
+    arena->used = sizeof(char*);
+    arena->size = size;
+  }
+  copy = arena->block + arena->used;
+  memcpy(copy, name, len);
+  arena->used += len;
+  return copy;
+}
+
+static void name_arena_free(name_arena_t* arena)
+{
+  while (arena->block != NULL) {
+    char *prev = *(char**)arena->block;
+    free(arena->block);
+    arena->block = prev;
+  }
+  name_arena_init(arena);
+}
+
+// directory reading, a getdents64() buffer full of entries at a time
+#define DIRENT_BUFFER_SIZE 0x40000
+
+// the record getdents64() returns, see getdents(2)
+typedef struct vvfat_dirent64_t {
+  Bit64u d_ino;
+  Bit64s d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} vvfat_dirent64_t;
+
+typedef struct dirent_reader_t {
+  int fd;
+  Bit8u *buffer;
+  int length, offset;
+} dirent_reader_t;
+
+// reads the next buffer full of entries, returns 0 at the end
+static int dirent_fill(dirent_reader_t* reader)
+{
+  reader->length = syscall(SYS_getdents64, reader->fd, reader->buffer, DIRENT_BUFFER_SIZE);
+  reader->offset = 0;
+  return reader->length > 0;
+}
+
+// the next entry of the buffer, NULL at its end
+static vvfat_dirent64_t* dirent_next(dirent_reader_t* reader)
+{
+  vvfat_dirent64_t *entry;
+
+  if (reader->offset >= reader->length)
+    return NULL;
+  entry = (vvfat_dirent64_t*)(reader->buffer + reader->offset);
+  reader->offset += entry->d_reclen;
+  return entry;
+}
+
+// statx() is asked only for what the directory entries use, and not to sync
+// with a network file server
+#define VVFAT_STATX_FLAGS (AT_STATX_DONT_SYNC | AT_NO_AUTOMOUNT)
+#define VVFAT_STATX_MASK  (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME | \
+                           STATX_MTIME | STATX_CTIME)
+
+#ifdef STATX_BASIC_STATS
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_mode = stx->stx_mode;
+  st->st_size = stx->stx_size;
+  st->st_atime = stx->stx_atime.tv_sec;
+  st->st_mtime = stx->stx_mtime.tv_sec;
+  st->st_ctime = stx->stx_ctime.tv_sec;
+}
+#endif
+
+// stat() of a name in the directory dirfd
+static int stat_at(int dirfd, const char *name, struct stat *st)
+{
+#ifdef STATX_BASIC_STATS
+  struct statx stx;
+
+  if (statx(dirfd, name, VVFAT_STATX_FLAGS, VVFAT_STATX_MASK, &stx) == 0) {
+    statx_to_stat(&stx, st);
+    return 0;
+  }
+  if (errno != ENOSYS)
+    return -1;
+#endif
+  return fstatat(dirfd, name, st, AT_NO_AUTOMOUNT);
+}
+
+// an entry of the getdents64() buffer read_directory() works on
+typedef struct dirscan_t {
+  vvfat_dirent64_t *entry;
+  int result;  // 0 or -errno
+  struct stat st;
+} dirscan_t;
+
+// read_directory() hands the entries of a getdents64() buffer to the kernel
+// as IORING_OP_STATX batches, so the lookups of a cold cache or a network
+// file system overlap instead of waiting one after the other
+#define STAT_RING_ENTRIES 64
+
+#if defined(BUSE_IO_URING) && defined(STATX_BASIC_STATS)
+struct stat_ring_t {
+  struct uring ring;
+  struct statx stx[STAT_RING_ENTRIES];
+};
+
+static stat_ring_t* stat_ring_open(void)
+{
+  stat_ring_t *sr = (stat_ring_t*)malloc(sizeof(stat_ring_t));
+
+  if ((sr != NULL) && (uring_setup(&sr->ring, STAT_RING_ENTRIES, 0) < 0)) {
+    free(sr);
+    sr = NULL;
+  }
+  return sr;
+}
+
+static void stat_ring_close(stat_ring_t* sr)
+{
+  if (sr != NULL) {
+    uring_close(&sr->ring);
+    free(sr);
+  }
+}
+
+// takes the completions there are, returns how many
+static int stat_ring_reap(stat_ring_t* sr, dirscan_t* scan)
+{
+  struct uring *ring = &sr->ring;
+  struct io_uring_cqe *cqe;
+  unsigned head = *ring->cq_head;
+  int n = 0, i;
+
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    i = (int)cqe->user_data;
+    scan[i].result = cqe->res;
+    if (cqe->res == 0)
+      statx_to_stat(&sr->stx[i], &scan[i].st);
+    head++;
+    n++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+// statx() of count entries, a ring full at a time; -1 if the ring failed,
+// -2 if it failed with requests still in flight that may write to sr
+static int stat_ring_batch(stat_ring_t* sr, int dirfd, dirscan_t* scan, int count)
+{
+  struct uring *ring = &sr->ring;
+  struct io_uring_sqe *sqe;
+  int n, pending, i;
+
+  for (; count > 0; scan += n, count -= n) {
+    n = (count < STAT_RING_ENTRIES) ? count : STAT_RING_ENTRIES;
+    for (i = 0; i < n; i++) {
+      sqe = uring_get_sqe(ring);
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = dirfd;
+      sqe->addr = (unsigned long)scan[i].entry->d_name;
+      sqe->len = VVFAT_STATX_MASK;
+      sqe->off = (unsigned long)&sr->stx[i];
+      sqe->statx_flags = VVFAT_STATX_FLAGS;
+      sqe->user_data = i;
+    }
+    for (pending = n; pending > 0; pending -= stat_ring_reap(sr, scan)) {
+      if (uring_enter(ring, pending) < 0) {
+        // what wasn't submitted never completes; the rest has to before
+        // the caller may free sr
+        pending -= ring->to_submit;
+        ring->to_submit = 0;
+        while ((pending -= stat_ring_reap(sr, scan)) > 0) {
+          if (uring_enter(ring, pending) < 0)
+            return -2;
+        }
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+#else
+struct stat_ring_t {
+  int unused;
+};
+
+static stat_ring_t* stat_ring_open(void)
+{
+  return NULL;
+}
+
+static void stat_ring_close(stat_ring_t* sr)
+{
+}
+
+static int stat_ring_batch(stat_ring_t* sr, int dirfd, dirscan_t* scan, int count)
+{
+  return -1;
+}
+#endif
+
+// stat() of the scanned entries, through the ring if there is one. The
+// entries it failed on are stat()ed one by one, if the ring itself fails
+// it isn't used again.
+static void stat_entries(stat_ring_t** sr, int dirfd, dirscan_t* scan, int count)
+{
+  int i, ret;
+
+  for (i = 0; i < count; i++)
+    scan[i].result = -EAGAIN;
+  if ((*sr != NULL) && ((ret = stat_ring_batch(*sr, dirfd, scan, count)) < 0)) {
+    // with requests in flight the ring and its buffers are left to them
+    if (ret != -2)
+      stat_ring_close(*sr);
+    *sr = NULL;
+  }
+  for (i = 0; i < count; i++) {
+    if ((scan[i].result < 0) && (scan[i].result != -ENOENT))
+      scan[i].result = (stat_at(dirfd, scan[i].entry->d_name, &scan[i].st) < 0) ? -errno : 0;
+  }
+}
+
+// short name table functions; open addressing, kept at most half full
+#define SHORTNAME_TABLE_MIN 256
+
+static inline void shortname_table_init(shortname_table_t* table)
+{
+  table->slots = NULL;
+  table->size = table->count = 0;
+  table->generation = 1;
+  table->directory_start = -1;
+}
+
+static void shortname_table_free(shortname_table_t* table)
+{
+  free(table->slots);
+  shortname_table_init(table);
+}
+
+// empties the table for the directory starting at directory_start
+static inline void shortname_table_reset(shortname_table_t* table, int directory_start)
+{
+  table->generation++;
+  table->count = 0;
+  table->directory_start = directory_start;
+}
+
+static inline Bit32u shortname_hash(const Bit8u* name)
+{
+  Bit32u hash = 2166136261u;
+
+  for (int i = 0; i < 11; i++)
+    hash = (hash ^ name[i]) * 16777619u;
+  return hash;
+}
+
+static shortname_slot_t* shortname_probe(shortname_slot_t* slots, Bit32u size,
+                                         Bit32u generation, const Bit8u* name)
+{
+  Bit32u i = shortname_hash(name) & (size - 1);
+
+  while ((slots[i].generation == generation) && memcmp(slots[i].name, name, 11))
+    i = (i + 1) & (size - 1);
+  return &slots[i];
+}
+
+// the slot of name; NULL if there is none and insert is not set
+static shortname_slot_t* shortname_slot(shortname_table_t* table, const Bit8u* name,
+                                        bx_bool insert)
+{
+  shortname_slot_t *slot;
+
+  if (table->size == 0) {
+    if (!insert)
+      return NULL;
+  } else {
+    slot = shortname_probe(table->slots, table->size, table->generation, name);
+    if (slot->generation == table->generation)
+      return slot;
+    if (!insert)
+      return NULL;
+  }
+  if ((table->count + 1) * 2 > table->size) {
+    Bit32u size = table->size ? table->size * 2 : SHORTNAME_TABLE_MIN;
+    shortname_slot_t *slots = (shortname_slot_t*)calloc(size, sizeof(shortname_slot_t));
+
+    for (Bit32u i = 0; i < table->size; i++) {
+      if (table->slots[i].generation == table->generation)
+        *shortname_probe(slots, size, table->generation, table->slots[i].name) = table->slots[i];
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->size = size;
+  }
+  slot = shortname_probe(table->slots, table->size, table->generation, name);
+  memset(slot, 0, sizeof(shortname_slot_t));
+  slot->generation = table->generation;
+  memcpy(slot->name, name, 11);
+  table->count++;
+  return slot;
+}
+
+// the name to try after a duplicate: all 8 characters are used for the
+// name, and its trailing digits are counted up
+static void mangle_short_name(Bit8u* name)
+{
+  int j;
+
+  if (name[7] == ' ') {
+    for (j = 6; j > 0 && name[j] == ' '; j--)
+      name[j] = '~';
+  }
+  for (j = 7; j > 0 && name[j] == '9'; j--)
+    name[j] = '0';
+  if (j > 0) {
+    if (name[j] < '0' || name[j] > '9')
+      name[j] = '0';
+    else
+      name[j]++;
+  }
+}
+
 typedef
   struct bootsector_t {
     Bit8u  jump[3];
@@ -868,10 +1432,36 @@ vvfat_image_t::vvfat_image_t(Bit64u size, const char* _redolog_name)
     printf("system error: invalid bootsector structure size\n");
   }
 
-  first_sectors = new Bit8u[0xc000];
-  memset(&first_sectors[0], 0, 0xc000);
+  first_sectors = NULL;
+  sector_size = 0x200;
+  cylinders = 0;
 
   hd_size = size;
+  write_through = 0;
+  write_through_fd = -1;
+  write_through_mapping = NULL;
+  unsynced = 0;
+  last_written = 0;
+  cluster_buffer = NULL;
+  dirty_fat = NULL;
+  dirty_clusters = NULL;
+  fat2 = NULL;
+  memset(&fat_ops, 0, sizeof(fat_ops));
+  dirstate_order = NULL;
+  dirstate_sorted = 0;
+  array_init(&dirstates, sizeof(dirstate_t));
+  name_arena_init(&names);
+  shortname_table_init(&shortnames);
+  dirent_buffer = NULL;
+  array_init(&dirscan, sizeof(dirscan_t));
+  stat_ring = NULL;
+  mapping_begin = NULL;
+  mapping_order = NULL;
+  mapping_begin_top = NULL;
+  mapping_top_count = 0;
+  lazy_depth = 0;
+  array_init(&lazy_dirs, sizeof(lazy_dir_t));
+  lazy_pending = 0;
   redolog = new redolog_t();
   redolog_temp = NULL;
   redolog_name = NULL;
@@ -1010,47 +1600,147 @@ static inline Bit8u fat_chksum(const direntry_t* entry)
   return chksum;
 }
 
-void vvfat_image_t::fat_set(unsigned int cluster, Bit32u value)
-{
-  if (fat_type == 32) {
-    Bit32u* entry = (Bit32u*)array_get(&fat, cluster);
-    *entry = htod32(value);
-  } else if (fat_type == 16) {
-    Bit16u* entry = (Bit16u*)array_get(&fat, cluster);
-    *entry = htod16(value & 0xffff);
-  } else {
-    int offset = (cluster * 3 / 2);
-    Bit8u* p = (Bit8u*)array_get(&fat, offset);
-    switch (cluster & 1) {
-      case 0:
-        p[0] = value & 0xff;
-        p[1] = (p[1] & 0xf0) | ((value>>8) & 0xf);
-        break;
-      case 1:
-        p[0] = (p[0]&0xf) | ((value&0xf)<<4);
-        p[1] = (value>>4);
-        break;
+// FAT entry access, one specialization per FAT width. init_fat() picks the
+// instantiation once, so walking or building a chain never looks at fat_type.
+// chain() fills a whole linear chain, with vector stores where there are any.
+template <int bits> struct fat_table;
+
+template <> struct fat_table<12> {
+  enum { max_value = 0xfff };
+  static Bit32u get(const void *table, Bit32u cluster)
+  {
+    const Bit8u *p = (const Bit8u*)table + cluster * 3 / 2;
+    Bit32u pair = p[0] | (p[1] << 8);
+    // odd entries take the high 12 bits of the byte pair
+    return (pair >> ((cluster & 1) * 4)) & 0xfff;
+  }
+  static void set(void *table, Bit32u cluster, Bit32u value)
+  {
+    Bit8u *p = (Bit8u*)table + cluster * 3 / 2;
+    unsigned shift = (cluster & 1) * 4;
+    Bit32u pair = p[0] | (p[1] << 8);
+
+    pair = (pair & ~(0xfff << shift)) | ((value & 0xfff) << shift);
+    p[0] = (Bit8u)pair;
+    p[1] = (Bit8u)(pair >> 8);
+  }
+  static void chain(void *table, Bit32u begin, Bit32u end)
+  {
+    Bit32u cluster = begin, last = end - 1, pair;
+    Bit8u *p;
+
+    if ((cluster & 1) && (cluster < last)) {
+      set(table, cluster, cluster + 1);
+      cluster++;
+    }
+    // an even entry and the odd one after it share three bytes
+    p = (Bit8u*)table + cluster * 3 / 2;
+    for (; cluster + 2 <= last; cluster += 2, p += 3) {
+      pair = ((cluster + 1) & 0xfff) | (((cluster + 2) & 0xfff) << 12);
+      p[0] = (Bit8u)pair;
+      p[1] = (Bit8u)(pair >> 8);
+      p[2] = (Bit8u)(pair >> 16);
+    }
+    for (; cluster < last; cluster++)
+      set(table, cluster, cluster + 1);
+    set(table, last, max_value);
+  }
+};
+
+template <> struct fat_table<16> {
+  enum { max_value = 0xffff };
+  static Bit32u get(const void *table, Bit32u cluster)
+  {
+    return dtoh16(((const Bit16u*)table)[cluster]);
+  }
+  static void set(void *table, Bit32u cluster, Bit32u value)
+  {
+    ((Bit16u*)table)[cluster] = htod16(value & 0xffff);
+  }
+  static void chain(void *table, Bit32u begin, Bit32u end)
+  {
+    Bit16u *entry = (Bit16u*)table + begin;
+    Bit32u cluster = begin, last = end - 1;
+
+#ifdef __SSE2__
+    __m128i next = _mm_setr_epi16(begin + 1, begin + 2, begin + 3, begin + 4,
+                                  begin + 5, begin + 6, begin + 7, begin + 8);
+    const __m128i step = _mm_set1_epi16(8);
+
+    for (; cluster + 8 <= last; cluster += 8, entry += 8) {
+      _mm_storeu_si128((__m128i*)entry, next);
+      next = _mm_add_epi16(next, step);
+    }
+#endif
+    for (; cluster < last; cluster++)
+      *entry++ = htod16(cluster + 1);
+    *entry = htod16(max_value);
+  }
+};
+
+template <> struct fat_table<32> {
+  enum { max_value = 0x0fffffff };
+  static Bit32u get(const void *table, Bit32u cluster)
+  {
+    return dtoh32(((const Bit32u*)table)[cluster]);
+  }
+  static void set(void *table, Bit32u cluster, Bit32u value)
+  {
+    ((Bit32u*)table)[cluster] = htod32(value);
+  }
+  static void chain(void *table, Bit32u begin, Bit32u end)
+  {
+    Bit32u *entry = (Bit32u*)table + begin;
+    Bit32u cluster = begin, last = end - 1;
+
+#ifdef __SSE2__
+    __m128i next = _mm_setr_epi32(begin + 1, begin + 2, begin + 3, begin + 4);
+    const __m128i step = _mm_set1_epi32(4);
+
+    for (; cluster + 4 <= last; cluster += 4, entry += 4) {
+      _mm_storeu_si128((__m128i*)entry, next);
+      next = _mm_add_epi32(next, step);
     }
+#endif
+    for (; cluster < last; cluster++)
+      *entry++ = htod32(cluster + 1);
+    *entry = htod32(max_value);
   }
+};
+
+template <int bits>
+static void fat_table_select(fat_ops_t *ops)
+{
+  ops->get = fat_table<bits>::get;
+  ops->set = fat_table<bits>::set;
+  ops->chain = fat_table<bits>::chain;
+  ops->max_value = fat_table<bits>::max_value;
+}
+
+void vvfat_image_t::fat_set(unsigned int cluster, Bit32u value)
+{
+  assert(cluster < cluster_count + 2);
+  fat_ops.set(fat.pointer, cluster, value);
 }
 
 void vvfat_image_t::init_fat(void)
 {
   if (fat_type == 12) {
     array_init(&fat, 1);
-    array_ensure_allocated(&fat, sectors_per_fat * 0x200 * 3 / 2 - 1);
+    array_ensure_allocated(&fat, sectors_per_fat * sector_size * 3 / 2 - 1);
   } else {
     array_init(&fat, (fat_type==32) ? 4:2);
-    array_ensure_allocated(&fat, sectors_per_fat * 0x200 / fat.item_size - 1);
+    array_ensure_allocated(&fat, sectors_per_fat * sector_size / fat.item_size - 1);
   }
   memset(fat.pointer, 0, fat.size);
 
   switch (fat_type) {
-    case 12: max_fat_value = 0xfff; break;
-    case 16: max_fat_value = 0xffff; break;
-    case 32: max_fat_value = 0x0fffffff; break;
-    default: max_fat_value = 0; /* error... */
+    case 12: fat_table_select<12>(&fat_ops); break;
+    case 16: fat_table_select<16>(&fat_ops); break;
+    case 32: fat_table_select<32>(&fat_ops); break;
+    default: fat_ops.max_value = 0; /* error... */
   }
+  max_fat_value = fat_ops.max_value;
 }
 
 direntry_t* vvfat_image_t::create_short_and_long_name(
@@ -1059,6 +1749,7 @@ direntry_t* vvfat_image_t::create_short_and_long_name(
   int i, j, long_index = directory.next;
   direntry_t* entry = NULL;
   direntry_t* entry_long = NULL;
+  shortname_slot_t* slot;
   char tempfn[BX_PATHNAME_LEN];
 
   if (is_dot) {
@@ -1068,6 +1759,16 @@ direntry_t* vvfat_image_t::create_short_and_long_name(
     return entry;
   }
 
+  if (shortnames.directory_start != (int)directory_start) {
+    // a new directory, take the entries it already has
+    shortname_table_reset(&shortnames, directory_start);
+    for (i = directory_start; i < (int)directory.next; i++) {
+      entry = (direntry_t*)array_get(&directory, i);
+      if (!is_long_name(entry))
+        shortname_slot(&shortnames, entry->name, 1)->taken = 1;
+    }
+  }
+
   entry_long = create_long_filename(filename);
 
   // short name should not contain spaces
@@ -1104,34 +1805,26 @@ direntry_t* vvfat_image_t::create_short_and_long_name(
   }
   if (entry->name[0] == 0xe5) entry->name[0] = 0x05;
 
-  // mangle duplicates
-  while (1) {
-    direntry_t* entry1 = (direntry_t*)array_get(&directory, directory_start);
-    int j;
-
-    for (;entry1<entry;entry1++)
-      if (!is_long_name(entry1) && !memcmp(entry1->name,entry->name,11))
-        break; // found dupe
-    if (entry1==entry) // no dupe found
-      break;
+  // mangle duplicates. Names are only added to a directory, so the names
+  // mangling this one gave before are still taken; go on after the last.
+  slot = shortname_slot(&shortnames, entry->name, 1);
+  if (slot->taken) {
+    Bit8u base[11];
 
-    // use all 8 characters of name
-    if (entry->name[7]==' ') {
-      int j;
-      for(j=6;j>0 && entry->name[j]==' ';j--)
-        entry->name[j]='~';
-    }
-
-    // increment number
-    for (j=7;j>0 && entry->name[j]=='9';j--)
-      entry->name[j]='0';
-    if (j > 0) {
-      if (entry->name[j]<'0' || entry->name[j]>'9')
-        entry->name[j]='0';
-      else
-        entry->name[j]++;
-    }
+    memcpy(base, entry->name, 11);
+    if (slot->mangled)
+      memcpy(entry->name, slot->last, 11);
+    do {
+      mangle_short_name(entry->name);
+      slot = shortname_slot(&shortnames, entry->name, 0);
+    } while ((slot != NULL) && slot->taken);
+    // reget the base, the table may have been rehashed
+    slot = shortname_slot(&shortnames, base, 0);
+    slot->mangled = 1;
+    memcpy(slot->last, entry->name, 11);
+    slot = shortname_slot(&shortnames, entry->name, 1);
   }
+  slot->taken = 1;
 
   // calculate checksum; propagate to long name
   if (entry_long) {
@@ -1155,7 +1848,7 @@ int vvfat_image_t::read_directory(int mapping_index)
 {
   mapping_t* mapping = (mapping_t*)array_get(&this->mapping, mapping_index);
   direntry_t* direntry;
-  const char* dirname = mapping->path;
+  char dirname[BX_PATHNAME_LEN];
   Bit32u first_cluster = mapping->begin;
   int parent_index = mapping->info.dir.parent_mapping_index;
   mapping_t* parent_mapping = (mapping_t*)
@@ -1163,13 +1856,21 @@ int vvfat_image_t::read_directory(int mapping_index)
   int first_cluster_of_parent = parent_mapping ? (int)parent_mapping->begin : -1;
   int count = 0;
 
-  DIR* dir = opendir(dirname);
-  struct dirent* entry;
-  int i;
+  mapping_path(mapping, dirname);
+  size_t dirname_len = strlen(dirname);
+  dirent_reader_t dir;
+  vvfat_dirent64_t* entry;
+  dirscan_t* scan;
+  int i, j;
 
   assert(mapping->mode & MODE_DIRECTORY);
 
-  if (!dir) {
+  if (dirent_buffer == NULL)
+    dirent_buffer = (Bit8u*)malloc(DIRENT_BUFFER_SIZE);
+  dir.fd = ::open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  dir.buffer = dirent_buffer;
+  dir.length = dir.offset = 0;
+  if (dir.fd < 0) {
     mapping->end = mapping->begin;
     return -1;
   }
@@ -1183,99 +1884,122 @@ int vvfat_image_t::read_directory(int mapping_index)
     direntry = create_short_and_long_name(i, "..", 1);
   }
 
-  // actually read the directory, and allocate the mappings
-  while ((entry=readdir(dir))) {
-    if ((first_cluster == 0) && (directory.next >= (Bit16u)(root_entries - 1))) {
-      printf("Too many entries in root directory, using only %d\n", count);
-      closedir(dir);
-      return -2;
-    }
-    unsigned int length = strlen(dirname) + 2 + strlen(entry->d_name);
-    char* buffer;
-    direntry_t* direntry;
-    struct stat st;
-    bx_bool is_dot = !strcmp(entry->d_name, ".");
-    bx_bool is_dotdot = !strcmp(entry->d_name, "..");
-    if ((first_cluster == first_cluster_of_root_dir) && (is_dotdot || is_dot))
-      continue;
+  // actually read the directory, and allocate the mappings; the entries of
+  // every getdents64() buffer are stat()ed together
+  while (dirent_fill(&dir)) {
+    dirscan.next = 0;
+    while ((entry = dirent_next(&dir))) {
+      if ((first_cluster == first_cluster_of_root_dir) &&
+          (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")))
+        continue;
 
-    buffer = (char*)malloc(length);
-    snprintf(buffer,length,"%s/%s",dirname,entry->d_name);
+      // devices, fifos and sockets have no data to show
+      if ((entry->d_type == DT_CHR) || (entry->d_type == DT_BLK) ||
+          (entry->d_type == DT_FIFO) || (entry->d_type == DT_SOCK))
+        continue;
 
-    if (stat(buffer, &st) < 0) {
-      free(buffer);
-      continue;
+      if (dirname_len + 1 + strlen(entry->d_name) >= BX_PATHNAME_LEN) {
+        printf("Path '%s/%s' is too long\n", dirname, entry->d_name);
+        continue;
+      }
+      scan = (dirscan_t*)array_get_next(&dirscan);
+      scan->entry = entry;
     }
+    stat_entries(&stat_ring, dir.fd, (dirscan_t*)dirscan.pointer, dirscan.next);
 
-    bx_bool is_mbr_file = !strcmp(entry->d_name, VVFAT_MBR);
-    bx_bool is_boot_file = !strcmp(entry->d_name, VVFAT_BOOT);
-    bx_bool is_attr_file = !strcmp(entry->d_name, VVFAT_ATTR);
-    if (first_cluster == first_cluster_of_root_dir) {
-      if (is_attr_file || ((is_mbr_file || is_boot_file) && (st.st_size == 512))) {
-        free(buffer);
+    for (j = 0; j < (int)dirscan.next; j++) {
+      if ((first_cluster == 0) && (directory.next >= (Bit16u)(root_entries - 1))) {
+        printf("Too many entries in root directory, using only %d\n", count);
+        ::close(dir.fd);
+        return -2;
+      }
+      direntry_t* direntry;
+      scan = (dirscan_t*)array_get(&dirscan, j);
+      if (scan->result < 0) {
         continue;
       }
-    }
+      entry = scan->entry;
+      struct stat st = scan->st;
+      bx_bool is_dot = !strcmp(entry->d_name, ".");
+      bx_bool is_dotdot = !strcmp(entry->d_name, "..");
 
-    count++;
-    // create directory entry for this file
-    if (!is_dot && !is_dotdot) {
-      direntry = create_short_and_long_name(i, entry->d_name, 0);
-    } else {
-      direntry = (direntry_t*)array_get(&directory, is_dot ? i : i + 1);
-    }
-    direntry->attributes = (S_ISDIR(st.st_mode) ? 0x10 : 0x20);
-    direntry->reserved[0] = direntry->reserved[1]=0;
-    direntry->ctime = fat_datetime(st.st_ctime, 1);
-    direntry->cdate = fat_datetime(st.st_ctime, 0);
-    direntry->adate = fat_datetime(st.st_atime, 0);
-    direntry->begin_hi = 0;
-    direntry->mtime = fat_datetime(st.st_mtime, 1);
-    direntry->mdate = fat_datetime(st.st_mtime, 0);
-    if (is_dotdot)
-      set_begin_of_direntry(direntry, first_cluster_of_parent);
-    else if (is_dot)
-      set_begin_of_direntry(direntry, first_cluster);
-    else
-      direntry->begin = 0; // do that later
-    if (st.st_size > 0x7fffffff) {
-      printf("File '%s' is larger than 2GB\n", buffer);
-      free(buffer);
-      closedir(dir);
-      return -3;
-    }
-    direntry->size = htod32(S_ISDIR(st.st_mode) ? 0:st.st_size);
-
-    // create mapping for this file
-    if (!is_dot && !is_dotdot && (S_ISDIR(st.st_mode) || st.st_size)) {
-      current_mapping = (mapping_t*)array_get_next(&this->mapping);
-      current_mapping->begin = 0;
-      current_mapping->end = st.st_size;
-      /*
-       * we get the direntry of the most recent direntry, which
-       * contains the short name and all the relevant information.
-       */
-      current_mapping->dir_index = directory.next-1;
-      current_mapping->first_mapping_index = -1;
-      if (S_ISDIR(st.st_mode)) {
-        current_mapping->mode = MODE_DIRECTORY;
-        current_mapping->info.dir.parent_mapping_index =
-          mapping_index;
+      if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        continue;
+      }
+
+      bx_bool is_mbr_file = !strcmp(entry->d_name, VVFAT_MBR);
+      bx_bool is_boot_file = !strcmp(entry->d_name, VVFAT_BOOT);
+      bx_bool is_attr_file = !strcmp(entry->d_name, VVFAT_ATTR);
+      bx_bool is_lazy_file = !strcmp(entry->d_name, VVFAT_LAZY);
+      if (first_cluster == first_cluster_of_root_dir) {
+        if (is_attr_file || is_lazy_file || ((is_mbr_file || is_boot_file) && (st.st_size == 512))) {
+          continue;
+        }
+      }
+
+      count++;
+      // create directory entry for this file
+      if (!is_dot && !is_dotdot) {
+        direntry = create_short_and_long_name(i, entry->d_name, 0);
       } else {
-        current_mapping->mode = MODE_UNDEFINED;
-        current_mapping->info.file.offset = 0;
+        direntry = (direntry_t*)array_get(&directory, is_dot ? i : i + 1);
+      }
+      direntry->attributes = (S_ISDIR(st.st_mode) ? 0x10 : 0x20);
+      direntry->reserved[0] = direntry->reserved[1]=0;
+      time_t stamps[3] = { st.st_ctime, st.st_atime, st.st_mtime };
+      Bit16u dates[3], times[3];
+      fat_datetimes(stamps, 3, dates, times);
+      direntry->ctime = times[0];
+      direntry->cdate = dates[0];
+      direntry->adate = dates[1];
+      direntry->begin_hi = 0;
+      direntry->mtime = times[2];
+      direntry->mdate = dates[2];
+      if (is_dotdot)
+        set_begin_of_direntry(direntry, first_cluster_of_parent);
+      else if (is_dot)
+        set_begin_of_direntry(direntry, first_cluster);
+      else
+        direntry->begin = 0; // do that later
+      if (st.st_size > 0x7fffffff) {
+        printf("File '%s/%s' is larger than 2GB\n", dirname, entry->d_name);
+        ::close(dir.fd);
+        return -3;
+      }
+      direntry->size = htod32(S_ISDIR(st.st_mode) ? 0:st.st_size);
+
+      // create mapping for this file
+      if (!is_dot && !is_dotdot && (S_ISDIR(st.st_mode) || st.st_size)) {
+        current_mapping = (mapping_t*)array_get_next(&this->mapping);
+        current_mapping->begin = 0;
+        current_mapping->end = st.st_size;
+        /*
+         * we get the direntry of the most recent direntry, which
+         * contains the short name and all the relevant information.
+         */
+        current_mapping->dir_index = directory.next-1;
+        current_mapping->first_mapping_index = -1;
+        if (S_ISDIR(st.st_mode)) {
+          current_mapping->mode = MODE_DIRECTORY;
+          current_mapping->info.dir.parent_mapping_index =
+            mapping_index;
+        } else {
+          current_mapping->mode = MODE_UNDEFINED;
+          current_mapping->info.file.offset = 0;
+        }
+        current_mapping->name = name_arena_strdup(&names, entry->d_name);
+        current_mapping->parent = mapping_index;
+        current_mapping->read_only =
+          (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0;
+        current_mapping->written_through = 0;
+        current_mapping->fat_dirty = 0;
       }
-      current_mapping->path = buffer;
-      current_mapping->read_only =
-        (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0;
-    } else {
-      free(buffer);
     }
   }
-  closedir(dir);
+  ::close(dir.fd);
 
   // fill with zeroes up to the end of the cluster
-  while (directory.next % (0x10 * sectors_per_cluster)) {
+  while (directory.next % (cluster_size / 0x20)) {
     direntry_t* direntry = (direntry_t*)array_get_next(&directory);
     memset(direntry, 0, sizeof(direntry_t));
   }
@@ -1316,27 +2040,298 @@ off_t vvfat_image_t::cluster2sector(Bit32u cluster_num)
     return (off_t)(offset_to_data + (cluster_num - 2) * sectors_per_cluster);
 }
 
+// levels below the root directory
+int vvfat_image_t::mapping_depth(const mapping_t *mapping)
+{
+  int depth = 0;
+
+  while (mapping->parent >= 0) {
+    mapping = (mapping_t*)array_get(&this->mapping, mapping->parent);
+    depth++;
+  }
+  return depth;
+}
+
+// Gives the mapping its clusters from *cluster on and advances *cluster
+// past them. A directory is read, which appends the mappings of its
+// entries; with defer set, one lazy_depth levels down is only added to
+// lazy_dirs. Returns -1 if the directory could not be read, -2 if the
+// mapping would end beyond limit.
+int vvfat_image_t::lay_out_mapping(unsigned index, Bit32u *cluster, Bit32u limit, bx_bool defer)
+{
+  mapping_t* mapping = (mapping_t*)array_get(&this->mapping, index);
+  // fix fat entry if not root directory of FAT12/FAT16
+  int fix_fat = (*cluster != 0);
+
+  if (mapping->mode & MODE_DIRECTORY) {
+    if (defer && (lazy_depth > 0) && (mapping_depth(mapping) >= lazy_depth)) {
+      lazy_dir_t* lazy = (lazy_dir_t*)array_get_next(&lazy_dirs);
+      if (lazy == NULL)
+        return -1;
+      memset(lazy, 0, sizeof(lazy_dir_t));
+      lazy->mapping_index = index;
+      mapping->mode |= MODE_LAZY;
+      return 0;
+    }
+    mapping->begin = *cluster;
+    if (read_directory(index))
+      return -1;
+    mapping = (mapping_t*)array_get(&this->mapping, index);
+  } else {
+    assert(mapping->mode == MODE_UNDEFINED);
+    mapping->mode = MODE_NORMAL;
+    mapping->begin = *cluster;
+    if (mapping->end > 0) {
+      direntry_t* direntry = (direntry_t*)array_get(&directory, mapping->dir_index);
+
+      mapping->end = *cluster + 1 + (mapping->end-1) / cluster_size;
+      set_begin_of_direntry(direntry, mapping->begin);
+    } else {
+      mapping->end = *cluster + 1;
+      fix_fat = 0;
+    }
+  }
+
+  assert(mapping->begin < mapping->end);
+
+  if (mapping->end > limit)
+    return -2;
+
+  /* next free cluster */
+  *cluster = mapping->end;
+
+  // fix fat for entry
+  if (fix_fat) {
+    fat_ops.chain(fat.pointer, mapping->begin, mapping->end);
+  }
+  return 0;
+}
+
+// Leaves the mappings from first on out of the image: they are forgotten
+// and their directory entries, long names included, are marked deleted.
+void vvfat_image_t::drop_mappings(unsigned first)
+{
+  mapping_t* mapping;
+  direntry_t* entry;
+  unsigned i, index;
+
+  for (i = first; i < this->mapping.next; i++) {
+    mapping = (mapping_t*)array_get(&this->mapping, i);
+    index = mapping->dir_index;
+    do {
+      entry = (direntry_t*)array_get(&directory, index);
+      entry->name[0] = 0xe5;
+    } while ((index-- > 0) && is_long_name((direntry_t*)array_get(&directory, index)));
+  }
+  this->mapping.next = first;
+}
+
+// Lazy subtrees
+//
+// With a lazy depth set, the directories that many levels down are not read
+// by init_directories(). Each gets a range of clusters reserved instead:
+// what its subtree took last time, as far as VVFAT_LAZY remembers, plus an
+// equal share of what is left. The guest can only learn about a subtree
+// through its clusters or through their FAT entries, so the first access to
+// either (see materialize()) reads the whole subtree and lays it out inside
+// the reservation. Clusters of the reservation it doesn't need become free.
+
+int vvfat_image_t::reserve_lazy_dirs(Bit32u *cluster)
+{
+  char path[BX_PATHNAME_LEN];
+  char line[BX_PATHNAME_LEN + 32];
+  lazy_dir_t* lazy;
+  mapping_t* mapping;
+  Bit32u free_clusters = cluster_count + 2 - *cluster, known = 0, share;
+  Bit64u size;
+  unsigned i;
+  int n;
+  FILE* fd;
+
+  if (*cluster + lazy_dirs.next > cluster_count + 2)
+    return -2;
+  sprintf(path, "%s/%s", vvfat_path, VVFAT_LAZY);
+  fd = fopen(path, "r");
+  if (fd != NULL) {
+    while (fgets(line, sizeof(line), fd) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      if (sscanf(line, "%llu %n", (unsigned long long*)&size, &n) < 1)
+        continue;
+      snprintf(path, BX_PATHNAME_LEN, "%s/%s", vvfat_path, line + n);
+      for (i = 0; i < lazy_dirs.next; i++) {
+        lazy = (lazy_dir_t*)array_get(&lazy_dirs, i);
+        mapping = (mapping_t*)array_get(&this->mapping, lazy->mapping_index);
+        if (mapping_has_path(mapping, path, strlen(path))) {
+          lazy->estimate = (Bit32u)((size + cluster_size - 1) / cluster_size);
+          known += lazy->estimate;
+          break;
+        }
+      }
+    }
+    fclose(fd);
+  }
+  if (known > free_clusters - lazy_dirs.next) {
+    // the tree shrank, or the image did
+    for (i = 0; i < lazy_dirs.next; i++)
+      ((lazy_dir_t*)array_get(&lazy_dirs, i))->estimate = 0;
+    known = 0;
+  }
+  share = (free_clusters - known) / lazy_dirs.next;
+  for (i = 0; i < lazy_dirs.next; i++) {
+    lazy = (lazy_dir_t*)array_get(&lazy_dirs, i);
+    lazy->begin = *cluster;
+    lazy->end = *cluster + lazy->estimate + share;
+    if (i == lazy_dirs.next - 1)
+      lazy->end = cluster_count + 2;
+    lazy->pending = 1;
+    *cluster = lazy->end;
+    // until it is populated the directory spans the reservation, its first
+    // cluster being all the FAT shows of it
+    mapping = (mapping_t*)array_get(&this->mapping, lazy->mapping_index);
+    mapping->begin = lazy->begin;
+    mapping->end = lazy->end;
+    set_begin_of_direntry((direntry_t*)array_get(&directory, mapping->dir_index),
+                          mapping->begin);
+    fat_ops.chain(fat.pointer, lazy->begin, lazy->begin + 1);
+  }
+  lazy_pending = lazy_dirs.next;
+  return 0;
+}
+
+void vvfat_image_t::populate_lazy_dir(unsigned index)
+{
+  lazy_dir_t* lazy = (lazy_dir_t*)array_get(&lazy_dirs, index);
+  mapping_t* mapping = (mapping_t*)array_get(&this->mapping, lazy->mapping_index);
+  char path[BX_PATHNAME_LEN];
+  unsigned first = this->mapping.next, i;
+  Bit32u cluster = lazy->begin, c;
+  int ret;
+
+  lazy->pending = 0;
+  lazy_pending--;
+  // read_directory() uses current_mapping for its own purposes, and the
+  // mappings it adds may move the array write_through_mapping points into
+  close_current_file();
+  close_write_through();
+  mapping->mode &= ~MODE_LAZY;
+  stat_ring = stat_ring_open();
+  ret = lay_out_mapping(lazy->mapping_index, &cluster, lazy->end, 0);
+  if (ret < 0) {
+    // left empty, not even . and ..
+    this->mapping.next = first;
+    mapping = (mapping_t*)array_get(&this->mapping, lazy->mapping_index);
+    mapping_path(mapping, path);
+    if (ret == -1) {
+      printf("Could not read directory '%s'\n", path);
+    } else {
+      printf("Directory '%s' does not fit the %u clusters reserved for it\n",
+             path, lazy->end - lazy->begin);
+    }
+    mapping->info.dir.first_dir_index = directory.next;
+    for (c = 0; c < cluster_size / 0x20; c++)
+      memset(array_get_next(&directory), 0, sizeof(direntry_t));
+    mapping->begin = lazy->begin;
+    mapping->end = cluster = lazy->begin + 1;
+    fat_ops.chain(fat.pointer, mapping->begin, mapping->end);
+  }
+  for (i = first; i < this->mapping.next; i++) {
+    ret = lay_out_mapping(i, &cluster, lazy->end, 0);
+    if (ret < 0) {
+      mapping = (mapping_t*)array_get(&this->mapping, lazy->mapping_index);
+      mapping_path(mapping, path);
+      printf("'%s' does not fit the %u clusters reserved for it, %u entries left out\n",
+             path, lazy->end - lazy->begin, this->mapping.next - i);
+      drop_mappings(i);
+    }
+  }
+  stat_ring_close(stat_ring);
+  stat_ring = NULL;
+  free(dirent_buffer);
+  dirent_buffer = NULL;
+  array_free(&dirscan);
+  array_init(&dirscan, sizeof(dirscan_t));
+  close_current_file();
+
+  // the guest has not seen these FAT entries yet, the shadow takes them over
+  lazy->used = cluster - lazy->begin;
+  for (c = lazy->begin; c < lazy->end; c++)
+    fat_ops.set(fat2, c, fat_ops.get(fat.pointer, c));
+  index_mappings();
+  init_dirstates(first);
+  set_file_attributes(first);
+}
+
+// populates the lazy subtrees with a cluster in [first, end)
+void vvfat_image_t::materialize_clusters(Bit32u first, Bit32u end)
+{
+  lazy_dir_t* lazy;
+  unsigned low = 0, high = lazy_dirs.next, mid;
+
+  // the first reservation that ends after first
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (((lazy_dir_t*)array_get(&lazy_dirs, mid))->end <= first)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  for (; low < lazy_dirs.next; low++) {
+    lazy = (lazy_dir_t*)array_get(&lazy_dirs, low);
+    if (lazy->begin >= end)
+      break;
+    if (lazy->pending)
+      populate_lazy_dir(low);
+  }
+}
+
+// populates the lazy subtrees the guest is about to see in the sectors from
+// sector on: their clusters, or FAT sectors with entries of them
+void vvfat_image_t::materialize(Bit32u sector, Bit32u count)
+{
+  Bit32u end = sector + count, fat_begin, first, last;
+  int copy;
+
+  if (lazy_pending == 0)
+    return;
+  for (copy = 0; copy < 2; copy++) {
+    fat_begin = offset_to_fat + copy * sectors_per_fat;
+    first = (sector > fat_begin) ? sector : fat_begin;
+    last = (end < fat_begin + sectors_per_fat) ? end : fat_begin + sectors_per_fat;
+    if (first < last) {
+      materialize_clusters((first - fat_begin) * sector_size * 8 / fat_type,
+                           ((last - fat_begin) * sector_size * 8 + fat_type - 1) / fat_type);
+    }
+  }
+  if (end > offset_to_data) {
+    first = (sector > offset_to_data) ? sector : offset_to_data;
+    materialize_clusters(sector2cluster(first), sector2cluster(end - 1) + 1);
+  }
+}
+
 int vvfat_image_t::init_directories(const char* dirname)
 {
   bootsector_t* bootsector;
   infosector_t* infosector;
   mapping_t* mapping;
   unsigned int i;
-  unsigned int cluster;
+  unsigned int cluster, root_dir_sectors;
+  char *root_path;
   char size_txt[8];
   Bit64u volume_sector_count = 0, tmpsc;
+  int ret;
 
-  cluster_size   = sectors_per_cluster * 0x200;
+  cluster_size   = sectors_per_cluster * sector_size;
   cluster_buffer = new Bit8u[cluster_size];
+  root_dir_sectors = root_entries * 32 / sector_size;
 
-  bootsector = (bootsector_t*)(first_sectors + offset_to_bootsector * 0x200);
+  bootsector = (bootsector_t*)(first_sectors + offset_to_bootsector * sector_size);
 
   if (!use_boot_file) {
     volume_sector_count = sector_count - offset_to_bootsector;
-    tmpsc = volume_sector_count - reserved_sectors - root_entries / 16;
-    cluster_count = (Bit32u)((tmpsc * 0x200) / ((sectors_per_cluster * 0x200) + fat_type / 4));
-    sectors_per_fat = ((cluster_count + 2) * fat_type / 8) / 0x200;
-    sectors_per_fat += (((cluster_count + 2) * fat_type / 8) % 0x200) > 0;
+    tmpsc = volume_sector_count - reserved_sectors - root_dir_sectors;
+    cluster_count = (Bit32u)((tmpsc * sector_size) / ((sectors_per_cluster * sector_size) + fat_type / 4));
+    sectors_per_fat = ((cluster_count + 2) * fat_type / 8) / sector_size;
+    sectors_per_fat += (((cluster_count + 2) * fat_type / 8) % sector_size) > 0;
   } else {
     if (fat_type != 32) {
       sectors_per_fat = bootsector->sectors_per_fat;
@@ -1347,11 +2342,16 @@ int vvfat_image_t::init_directories(const char* dirname)
 
   offset_to_fat = offset_to_bootsector + reserved_sectors;
   offset_to_root_dir = offset_to_fat + sectors_per_fat * 2;
-  offset_to_data = offset_to_root_dir + root_entries / 16;
+  offset_to_data = offset_to_root_dir + root_dir_sectors;
   if (use_boot_file) {
     cluster_count = (sector_count - offset_to_data) / sectors_per_cluster;
   }
 
+  dirty_fat = new Bit8u[(cluster_count + 2 + 7) / 8];
+  memset(dirty_fat, 0, (cluster_count + 2 + 7) / 8);
+  dirty_clusters = new Bit8u[(cluster_count + 2 + 7) / 8];
+  memset(dirty_clusters, 0, (cluster_count + 2 + 7) / 8);
+
   array_init(&this->mapping, sizeof(mapping_t));
   array_init(&directory, sizeof(direntry_t));
 
@@ -1373,66 +2373,49 @@ int vvfat_image_t::init_directories(const char* dirname)
   mapping->dir_index = 0;
   mapping->info.dir.parent_mapping_index = -1;
   mapping->first_mapping_index = -1;
-  mapping->path = strdup(dirname);
-  i = strlen(mapping->path);
-  if (i > 0 && mapping->path[i - 1] == '/')
-    mapping->path[i - 1] = '\0';
+  root_path = (char*)name_arena_strdup(&names, dirname);
+  i = strlen(root_path);
+  if (i > 0 && root_path[i - 1] == '/')
+    root_path[i - 1] = '\0';
+  mapping->name = root_path;
+  mapping->parent = -1;
   mapping->mode = MODE_DIRECTORY;
   mapping->read_only = 0;
-  vvfat_path = mapping->path;
-
-  for (i = 0, cluster = first_cluster_of_root_dir; i < this->mapping.next; i++) {
-    // fix fat entry if not root directory of FAT12/FAT16
-    int fix_fat = (cluster != 0);
-    mapping = (mapping_t*)array_get(&this->mapping, i);
-
-    if (mapping->mode & MODE_DIRECTORY) {
-      mapping->begin = cluster;
-      if (read_directory(i)) {
-        printf("Could not read directory '%s'\n", mapping->path);
-        return -1;
-      }
-      mapping = (mapping_t*)array_get(&this->mapping, i);
-    } else {
-      assert(mapping->mode == MODE_UNDEFINED);
-      mapping->mode = MODE_NORMAL;
-      mapping->begin = cluster;
-      if (mapping->end > 0) {
-        direntry_t* direntry = (direntry_t*)array_get(&directory, mapping->dir_index);
-
-        mapping->end = cluster + 1 + (mapping->end-1) / cluster_size;
-        set_begin_of_direntry(direntry, mapping->begin);
-      } else {
-        mapping->end = cluster + 1;
-        fix_fat = 0;
-      }
-    }
-
-    assert(mapping->begin < mapping->end);
-
-    /* next free cluster */
-    cluster = mapping->end;
-
-    if (cluster >= (cluster_count + 2)) {
-      sprintf(size_txt, "%d", (sector_count >> 11));
-      printf("Directory does not fit in FAT%d (capacity %s MB)\n",
-                fat_type,
-                (fat_type == 12) ? (sector_count == 2880) ? "1.44":"2.88"
-                : size_txt);
-      return -EINVAL;
-    }
-
-    // fix fat for entry
-    if (fix_fat) {
-      int j;
-      for (j = mapping->begin; j < (int)(mapping->end - 1); j++)
-        fat_set(j, j + 1);
-      fat_set(mapping->end - 1, max_fat_value);
-    }
+  mapping->written_through = 0;
+  mapping->fat_dirty = 0;
+  vvfat_path = mapping->name;
+
+  stat_ring = stat_ring_open();
+  cluster = first_cluster_of_root_dir;
+  for (i = 0, ret = 0; (i < this->mapping.next) && (ret == 0); i++) {
+    ret = lay_out_mapping(i, &cluster, cluster_count + 2, 1);
+  }
+  if ((ret == 0) && (lazy_dirs.next > 0)) {
+    ret = reserve_lazy_dirs(&cluster);
+  }
+  if (ret == -1) {
+    char path[BX_PATHNAME_LEN];
+    mapping_path((mapping_t*)array_get(&this->mapping, i - 1), path);
+    printf("Could not read directory '%s'\n", path);
+    return -1;
+  } else if (ret < 0) {
+    sprintf(size_txt, "%d", (int)(((Bit64u)sector_count * sector_size) >> 20));
+    printf("Directory does not fit in FAT%d (capacity %s MB)\n",
+              fat_type,
+              (fat_type == 12) ? (sector_count == 2880) ? "1.44":"2.88"
+              : size_txt);
+    return -EINVAL;
   }
 
   mapping = (mapping_t*)array_get(&this->mapping, 0);
   assert((fat_type == 32) || (mapping->end == 2));
+  index_mappings();
+  free(dirent_buffer);
+  dirent_buffer = NULL;
+  array_free(&dirscan);
+  array_init(&dirscan, sizeof(dirscan_t));
+  stat_ring_close(stat_ring);
+  stat_ring = NULL;
 
   // the FAT signature
   fat_set(0, max_fat_value);
@@ -1449,7 +2432,7 @@ int vvfat_image_t::init_directories(const char* dirname)
     }
     bootsector->jump[2] = 0x90;
     memcpy(bootsector->name,"MSWIN4.1", 8); // Win95/98 need this to detect FAT32
-    bootsector->sector_size = htod16(0x200);
+    bootsector->sector_size = htod16(sector_size);
     bootsector->sectors_per_cluster = sectors_per_cluster;
     bootsector->reserved_sectors = htod16(reserved_sectors);
     bootsector->number_of_fats = 0x2;
@@ -1489,17 +2472,23 @@ int vvfat_image_t::init_directories(const char* dirname)
 
   if (fat_type == 32) {
     // backup boot sector
-    memcpy(&first_sectors[(offset_to_bootsector + 6) * 0x200], &first_sectors[offset_to_bootsector * 0x200], 0x200);
+    memcpy(&first_sectors[(offset_to_bootsector + 6) * sector_size],
+           &first_sectors[offset_to_bootsector * sector_size], sector_size);
     // FS info sector
-    infosector = (infosector_t*)(first_sectors + (offset_to_bootsector + 1) * 0x200);
+    infosector = (infosector_t*)(first_sectors + (offset_to_bootsector + 1) * sector_size);
     infosector->signature1 = htod32(0x41615252);
     infosector->signature2 = htod32(0x61417272);
-    infosector->free_clusters = htod32(cluster_count - cluster + 2);
+    // unknown with lazy subtrees, part of each reservation becomes free
+    infosector->free_clusters = htod32((lazy_dirs.next > 0) ? 0xffffffff : cluster_count - cluster + 2);
     infosector->mra_cluster = htod32(2);
     infosector->magic[0] = 0x55;
     infosector->magic[1] = 0xaa;
   }
 
+  fat2 = malloc(sectors_per_fat * sector_size);
+  memcpy(fat2, fat.pointer, sectors_per_fat * sector_size);
+  init_dirstates(0);
+
   return 0;
 }
 
@@ -1527,7 +2516,8 @@ bx_bool vvfat_image_t::read_sector_from_file(const char *path, Bit8u *buffer, Bi
   return (result == 0x200) && bootsig;
 }
 
-void vvfat_image_t::set_file_attributes(void)
+// applies VVFAT_ATTR to the mappings from first on
+void vvfat_image_t::set_file_attributes(unsigned first)
 {
   char path[BX_PATHNAME_LEN];
   char fpath[BX_PATHNAME_LEN];
@@ -1560,7 +2550,8 @@ void vvfat_image_t::set_file_attributes(void)
           sprintf(fpath, "%s/%s", vvfat_path, path);
         }
         mapping_t* mapping = find_mapping_for_path(fpath);
-        if (mapping != NULL) {
+        if ((mapping != NULL) &&
+            (mapping - (mapping_t*)this->mapping.pointer >= (int)first)) {
           direntry_t* entry = (direntry_t*)array_get(&directory, mapping->dir_index);
           attributes = entry->attributes;
           ptr = strtok(NULL, "");
@@ -1588,6 +2579,33 @@ void vvfat_image_t::set_file_attributes(void)
   }
 }
 
+// remembers the clusters the lazy subtrees took, see reserve_lazy_dirs()
+void vvfat_image_t::save_lazy_estimates(void)
+{
+  char path[BX_PATHNAME_LEN];
+  size_t root_len = strlen(vvfat_path);
+  lazy_dir_t* lazy;
+  Bit32u clusters;
+  FILE* fd;
+
+  sprintf(path, "%s/%s", vvfat_path, VVFAT_LAZY);
+  fd = fopen(path, "w");
+  if (fd == NULL)
+    return;
+  for (unsigned i = 0; i < lazy_dirs.next; i++) {
+    lazy = (lazy_dir_t*)array_get(&lazy_dirs, i);
+    clusters = lazy->pending ? lazy->estimate : lazy->used;
+    if (clusters == 0)
+      continue;
+    mapping_path((mapping_t*)array_get(&this->mapping, lazy->mapping_index), path);
+    if (strncmp(path, vvfat_path, root_len) || (path[root_len] != '/'))
+      continue;
+    fprintf(fd, "%llu %s\n", (unsigned long long)clusters * cluster_size,
+            path + root_len + 1);
+  }
+  fclose(fd);
+}
+
 int vvfat_image_t::open(const char* dirname)
 {
   Bit32u size_in_mb;
@@ -1603,6 +2621,15 @@ int vvfat_image_t::open(const char* dirname)
   fat_type = 0;
   sectors_per_cluster = 0;
 
+  if ((sector_size != 0x200) && (sector_size != 0x1000)) {
+    printf("VVFAT: unsupported sector size %d\n", sector_size);
+    return -1;
+  }
+  // MBR, the gap up to the partition and the reserved sectors
+  delete [] first_sectors;
+  first_sectors = new Bit8u[VVFAT_FIRST_SECTORS * sector_size];
+  memset(&first_sectors[0], 0, VVFAT_FIRST_SECTORS * sector_size);
+
   snprintf(path, BX_PATHNAME_LEN, "%s/%s", dirname, VVFAT_MBR);
   if (read_sector_from_file(path, sector_buffer, 0)) {
     mbr_t* real_mbr = (mbr_t*)sector_buffer;
@@ -1633,7 +2660,8 @@ int vvfat_image_t::open(const char* dirname)
   }
 
   snprintf(path, BX_PATHNAME_LEN, "%s/%s", dirname, VVFAT_BOOT);
-  if (read_sector_from_file(path, sector_buffer, 0)) {
+  if (read_sector_from_file(path, sector_buffer, 0) &&
+      (dtoh16(((bootsector_t*)sector_buffer)->sector_size) == sector_size)) {
     bootsector_t* bs = (bootsector_t*)sector_buffer;
     if (use_mbr_file) {
       sprintf(ftype, "FAT%d   ", fat_type);
@@ -1677,13 +2705,13 @@ int vvfat_image_t::open(const char* dirname)
       reserved_sectors = bs->reserved_sectors;
       root_entries = bs->root_entries;
       first_cluster_of_root_dir = (fat_type != 32) ? 0 : bs->u.fat32.first_cluster_of_root_dir;
-      memcpy(&first_sectors[offset_to_bootsector * 0x200], sector_buffer, 0x200);
+      memcpy(&first_sectors[offset_to_bootsector * sector_size], sector_buffer, 0x200);
       printf("VVFAT: using boot sector from file\n");
     }
   }
 
   if (!use_mbr_file && !use_boot_file) {
-    if (hd_size == 1474560) {
+    if ((hd_size == 1474560) && (sector_size == 0x200)) {
       // floppy support
       cylinders = 80;
       heads = 2;
@@ -1696,7 +2724,8 @@ int vvfat_image_t::open(const char* dirname)
       reserved_sectors = 1;
     } else {
       if (cylinders == 0) {
-        cylinders = 1024;
+        // same size in bytes whatever the sector size
+        cylinders = 1024 * 0x200 / sector_size;
         heads = 16;
         spt = 63;
       }
@@ -1705,7 +2734,7 @@ int vvfat_image_t::open(const char* dirname)
     sector_count = cylinders * heads * spt;
   }
 
-  hd_size = 512L * ((Bit64u)sector_count);
+  hd_size = (Bit64u)sector_size * sector_count;
   if (sectors_per_cluster == 0) {
     size_in_mb = (Bit32u)(hd_size >> 20);
     if ((size_in_mb >= 2047) || (fat_type == 32)) {
@@ -1739,6 +2768,8 @@ int vvfat_image_t::open(const char* dirname)
       root_entries = 512;
       reserved_sectors = 1;
     }
+    // the table above is for 512 byte sectors, keep the cluster size
+    sectors_per_cluster = (sectors_per_cluster * 0x200 + sector_size - 1) / sector_size;
   }
 
   current_cluster = 0xffff;
@@ -1748,7 +2779,7 @@ int vvfat_image_t::open(const char* dirname)
     init_mbr();
 
   init_directories(dirname);
-  set_file_attributes();
+  set_file_attributes(0);
 
   // VOLATILE WRITE SUPPORT
   snprintf(path, BX_PATHNAME_LEN, "%s/vvfat.dir", dirname);
@@ -1773,6 +2804,7 @@ int vvfat_image_t::open(const char* dirname)
     printf("Can't create volatile redolog '%s'\n", redolog_temp);
     return -1;
   }
+  redolog->set_block_size(sector_size);
   if (redolog->create(filedes, REDOLOG_SUBTYPE_VOLATILE, hd_size) < 0) {
     printf("Can't create volatile redolog '%s'\n", redolog_temp);
     return -1;
@@ -1842,24 +2874,63 @@ direntry_t* vvfat_image_t::read_direntry(Bit8u *buffer, char *filename)
 
 Bit32u vvfat_image_t::fat_get_next(Bit32u current)
 {
-  if (fat_type == 32) {
-    return dtoh32(((Bit32u*)fat2)[current]);
-  } else if (fat_type == 16) {
-    return dtoh16(((Bit16u*)fat2)[current]);
-  } else {
-    int offset = (current * 3 / 2);
-    Bit8u* p = (((Bit8u*)fat2) + offset);
-    Bit32u value = 0;
-    switch (current & 1) {
-      case 0:
-        value = p[0] | ((p[1] & 0x0f) << 8);
-        break;
-      case 1:
-        value = (p[0] >> 4) | (p[1] << 4);
-        break;
+  return fat_ops.get(fat2, current);
+}
+
+// whether the chain starting at fstart is exactly the clusters the file at
+// path had on the host, in order
+bx_bool vvfat_image_t::chain_in_place(const char *path, Bit32u fstart)
+{
+  mapping_t *mapping;
+  Bit32u cur, n = 0;
+
+  if (fstart < 2)
+    return 0;
+  mapping = find_mapping_for_cluster(fstart);
+  if ((mapping == NULL) || (mapping->mode != MODE_NORMAL) ||
+      (mapping->begin != fstart) || (mapping->info.file.offset != 0) ||
+      !mapping_has_path(mapping, path, strlen(path)))
+    return 0;
+  for (cur = fstart; cur < max_fat_value - 15; cur = fat_get_next(cur), n++) {
+    if ((cur != mapping->begin + n) || (cur >= mapping->end))
+      return 0;
+  }
+  return n == mapping->end - mapping->begin;
+}
+
+// Before the host file at path is replaced, what the guest sees of the
+// clusters it backs goes to the redolog; they aren't read from the host any
+// more.
+void vvfat_image_t::retire_mapping(const char *path)
+{
+  mapping_t *mapping;
+  Bit32u cluster_num, sector, i;
+  size_t len = strlen(path);
+  Bit8u *buffer = (Bit8u*)malloc(sector_size);
+  unsigned m;
+
+  for (m = 0; m < this->mapping.next; m++) {
+    mapping = (mapping_t*)array_get(&this->mapping, m);
+    if ((mapping->mode != MODE_NORMAL) || !mapping_has_path(mapping, path, len))
+      continue;
+    for (cluster_num = mapping->begin; cluster_num < mapping->end; cluster_num++) {
+      sector = cluster2sector(cluster_num);
+      for (i = 0; i < sectors_per_cluster; i++) {
+        redolog->lseek((Bit64s)(sector + i) * sector_size, SEEK_SET);
+        if ((ssize_t)redolog->read(buffer, sector_size) == sector_size)
+          continue;
+        if (read_cluster(cluster_num) != 0) {
+          memset(buffer, 0, sector_size);
+        } else {
+          memcpy(buffer, cluster + i * sector_size, sector_size);
+        }
+        redolog->lseek((Bit64s)(sector + i) * sector_size, SEEK_SET);
+        redolog->write(buffer, sector_size);
+      }
     }
-    return value;
+    mapping->mode = MODE_DELETED;
   }
+  free(buffer);
 }
 
 bx_bool vvfat_image_t::write_file(const char *path, direntry_t *entry, bx_bool create)
@@ -1868,25 +2939,23 @@ bx_bool vvfat_image_t::write_file(const char *path, direntry_t *entry, bx_bool c
   Bit32u csize, fsize, fstart, cur, next, rsvd_clusters, bad_cluster;
   Bit64u offset;
   Bit8u *buffer = NULL;
-  struct tm tv;
-  struct utimbuf ut;
+  char temp[BX_PATHNAME_LEN];
+  struct stat st;
+  mode_t mask;
+  bx_bool in_place;
 
-  csize = sectors_per_cluster * 0x200;
+  csize = sectors_per_cluster * sector_size;
   rsvd_clusters = max_fat_value - 15;
   bad_cluster = max_fat_value - 8;
   fsize = dtoh32(entry->size);
   fstart = dtoh16(entry->begin) | (dtoh16(entry->begin_hi) << 16);
-  if (create) {
-    fd = ::open(path, O_CREAT | O_RDWR | O_TRUNC
-#ifdef O_BINARY
-                | O_BINARY
-#endif
-#ifdef O_LARGEFILE
-                | O_LARGEFILE
-#endif
-                , 0644);
-  } else {
-    fd = ::open(path, O_RDWR | O_TRUNC
+  // Unchanged clusters are read back from the host file they came from. If
+  // the guest moved any of them, rewriting the file in order would overwrite
+  // data still to be read, so the new contents go to a file next to it that
+  // replaces it at the end.
+  in_place = !create && chain_in_place(path, fstart);
+  if (in_place) {
+    fd = ::open(path, O_RDWR
 #ifdef O_BINARY
                 | O_BINARY
 #endif
@@ -1894,6 +2963,21 @@ bx_bool vvfat_image_t::write_file(const char *path, direntry_t *entry, bx_bool c
                 | O_LARGEFILE
 #endif
                 );
+  } else {
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp)) {
+      printf("VVFAT: path too long: '%s'\n", path);
+      return 0;
+    }
+    fd = mkstemp(temp);
+    if (fd >= 0) {
+      if (!create && (stat(path, &st) == 0)) {
+        fchmod(fd, st.st_mode & 07777);
+      } else {
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+      }
+    }
   }
   if (fd < 0)
     return 0;
@@ -1902,7 +2986,7 @@ bx_bool vvfat_image_t::write_file(const char *path, direntry_t *entry, bx_bool c
   do {
     cur = next;
     offset = cluster2sector(cur);
-    lseek(offset * 0x200, SEEK_SET);
+    lseek(offset * sector_size, SEEK_SET);
     read(buffer, csize);
     if (fsize > csize) {
       ::write(fd, buffer, csize);
@@ -1915,7 +2999,32 @@ bx_bool vvfat_image_t::write_file(const char *path, direntry_t *entry, bx_bool c
       printf("reserved clusters not supported\n");
     }
   } while (next < rsvd_clusters);
+  if (in_place && (ftruncate(fd, dtoh32(entry->size)) < 0)) {
+    printf("VVFAT: could not truncate '%s'\n", path);
+  }
   ::close(fd);
+  if(buffer)
+    free(buffer);
+  if (!in_place) {
+    retire_mapping(path);
+    // the file being read from, or written through, may be open still
+    close_current_file();
+    close_write_through();
+    if (rename(temp, path) < 0) {
+      printf("VVFAT: could not replace '%s'\n", path);
+      unlink(temp);
+      return 0;
+    }
+  }
+
+  set_file_times(path, entry);
+  return 1;
+}
+
+void vvfat_image_t::set_file_times(const char *path, direntry_t *entry)
+{
+  struct tm tv;
+  struct utimbuf ut;
 
   tv.tm_year = (entry->mdate >> 9) + 80;
   tv.tm_mon = ((entry->mdate >> 5) & 0x0f) - 1;
@@ -1937,194 +3046,870 @@ bx_bool vvfat_image_t::write_file(const char *path, direntry_t *entry, bx_bool c
     ut.actime = ut.modtime;
   }
   utime(path, &ut);
-  if(buffer)
-    free(buffer);
-  return 1;
 }
 
-void vvfat_image_t::parse_directory(const char *path, Bit32u start_cluster)
+void vvfat_image_t::save_attributes(const char *path, direntry_t *entry)
 {
-  Bit32u csize, fstart, cur, next, size, rsvd_clusters;
-  Bit64u offset;
-  Bit8u *buffer, *ptr;
-  direntry_t *entry, *newentry;
-  char filename[BX_PATHNAME_LEN];
-  char full_path[BX_PATHNAME_LEN];
   char attr_txt[4];
   const char *rel_path;
-  mapping_t *mapping;
 
-  csize = sectors_per_cluster * 0x200;
-  rsvd_clusters = max_fat_value - 15;
-  if (start_cluster == 0) {
-    size = root_entries * 32;
-    offset = offset_to_root_dir;
-    buffer = (Bit8u*)malloc(size);
-    lseek(offset * 0x200, SEEK_SET);
-    read(buffer, size);
+  if ((vvfat_attr_fd == NULL) ||
+      (entry->attributes == 0x10) || (entry->attributes == 0x20))
+    return;
+
+  attr_txt[0] = 0;
+  if ((entry->attributes & 0x30) == 0) strcpy(attr_txt, "a");
+  if (entry->attributes & 0x04) strcpy(attr_txt, "S");
+  if (entry->attributes & 0x02) strcat(attr_txt, "H");
+  if (entry->attributes & 0x01) strcat(attr_txt, "R");
+  if (!strncmp(path, vvfat_path, strlen(vvfat_path))) {
+    rel_path = path + strlen(vvfat_path) + 1;
   } else {
-    size = csize;
-    buffer = (Bit8u*)malloc(size);
-    next = start_cluster;
-    do {
-      cur = next;
-      offset = cluster2sector(cur);
-      lseek(offset * 0x200, SEEK_SET);
-      read(buffer+(size-csize), csize);
-      next = fat_get_next(cur);
-      if (next < rsvd_clusters) {
-        size += csize;
-        buffer = (Bit8u*)realloc(buffer, size);
-      }
-    } while (next < rsvd_clusters);
+    rel_path = path;
   }
-  ptr = buffer;
-  do {
-    newentry = read_direntry(ptr, filename);
-    if (newentry != NULL) {
-      sprintf(full_path, "%s/%s", path, filename);
-      if ((newentry->attributes != 0x10) && (newentry->attributes != 0x20)) {
-        if (vvfat_attr_fd != NULL) {
-          attr_txt[0] = 0;
-          if ((newentry->attributes & 0x30) == 0) strcpy(attr_txt, "a");
-          if (newentry->attributes & 0x04) strcpy(attr_txt, "S");
-          if (newentry->attributes & 0x02) strcat(attr_txt, "H");
-          if (newentry->attributes & 0x01) strcat(attr_txt, "R");
-          if (!strncmp(full_path, vvfat_path, strlen(vvfat_path))) {
-            rel_path = (const char*)(full_path + strlen(vvfat_path) + 1);
-          } else {
-            rel_path = (const char*)full_path;
-          }
-          fprintf(vvfat_attr_fd, "\"%s\":%s\n", rel_path, attr_txt);
-        }
-      }
-      fstart = dtoh16(newentry->begin) | (dtoh16(newentry->begin_hi) << 16);
-      mapping = find_mapping_for_cluster(fstart);
-      if (mapping == NULL) {
-        if ((newentry->attributes & 0x10) > 0) {
-          bx_mkdir(full_path);
-          parse_directory(full_path, fstart);
-        } else {
-          if (access(full_path, F_OK) == 0) {
-            mapping = find_mapping_for_path(full_path);
-            if (mapping != NULL) {
-              mapping->mode &= ~MODE_DELETED;
-            }
-            write_file(full_path, newentry, 0);
-          } else {
-            write_file(full_path, newentry, 1);
-          }
-        }
-      } else {
-        entry = (direntry_t*)array_get(&directory, mapping->dir_index);
-        if (!strcmp(full_path, mapping->path)) {
-          if ((newentry->attributes & 0x10) > 0) {
-            parse_directory(full_path, fstart);
-            mapping->mode &= ~MODE_DELETED;
-          } else {
-            if ((newentry->mdate != entry->mdate) || (newentry->mtime != entry->mtime) ||
-                (newentry->size != entry->size)) {
-              write_file(full_path, newentry, 0);
-            }
-            mapping->mode &= ~MODE_DELETED;
-          }
-        } else {
-          if ((newentry->cdate == entry->cdate) && (newentry->ctime == entry->ctime)) {
-            rename(mapping->path, full_path);
-            if (newentry->attributes == 0x10) {
-              parse_directory(full_path, fstart);
-              mapping->mode &= ~MODE_DELETED;
-            } else {
-              if ((newentry->mdate != entry->mdate) || (newentry->mtime != entry->mtime) ||
-                  (newentry->size != entry->size)) {
-                write_file(full_path, newentry, 0);
-              }
-              mapping->mode &= ~MODE_DELETED;
-            }
-          } else {
-            if ((newentry->attributes & 0x10) > 0) {
-              bx_mkdir(full_path);
-              parse_directory(full_path, fstart);
-            } else {
-              if (access(full_path, F_OK) == 0) {
-                mapping = find_mapping_for_path(full_path);
-                if (mapping != NULL) {
-                  mapping->mode &= ~MODE_DELETED;
-                }
-                write_file(full_path, newentry, 0);
-              } else {
-                write_file(full_path, newentry, 1);
-              }
-            }
-          }
-        }
-      }
-      ptr = (Bit8u*)newentry+32;
-    }
-  } while ((newentry != NULL) && ((Bit32u)(ptr - buffer) < size));
-  free(buffer);
+  fprintf(vvfat_attr_fd, "\"%s\":%s\n", rel_path, attr_txt);
 }
 
-void vvfat_image_t::commit_changes(void)
+void vvfat_image_t::mark_sector_dirty(Bit32u sector, const void *buf)
 {
-  char path[BX_PATHNAME_LEN];
+  Bit32u index;
+
+  if (sector >= offset_to_data) {
+    index = sector2cluster(sector);
+    if (index >= cluster_count + 2)
+      return;
+    dirty_clusters[index / 8] |= 1 << (index % 8);
+  } else if (sector >= offset_to_root_dir) {
+    dirty_clusters[0] |= 1;
+  } else if (sector >= offset_to_fat) {
+    // both FAT copies update the same shadow sector
+    update_fat_sector((sector - offset_to_fat) % sectors_per_fat, (const Bit8u*)buf);
+  }
+}
+
+// Applies a written FAT sector to the shadow FAT and flags the entries that
+// changed, so commit_changes() never has to read the FAT back. The mapping of
+// a cluster is flagged the first time one of its entries changes.
+void vvfat_image_t::update_fat_sector(Bit32u index, const Bit8u *buf)
+{
+  Bit8u *shadow = (Bit8u*)fat2 + index * sector_size;
+  Bit32u i, cluster, first, last;
   mapping_t *mapping;
-  int i;
 
-  // read modified FAT
-  fat2 = malloc(sectors_per_fat * 0x200);
-  lseek(offset_to_fat * 0x200, SEEK_SET);
-  read(fat2, sectors_per_fat * 0x200);
-  // mark all mapped directories / files for delete
-  for (i = 1; i < (int)this->mapping.next; i++) {
-    mapping = (mapping_t*)array_get(&this->mapping, i);
-    if (mapping->first_mapping_index < 0) {
-      mapping->mode |= MODE_DELETED;
+  if (!memcmp(shadow, buf, sector_size))
+    return;
+  for (i = 0; i < sector_size; i++) {
+    if (shadow[i] == buf[i])
+      continue;
+    if (fat_type == 12) {
+      // a byte is shared by two 12 bit entries
+      cluster = (index * sector_size + i) * 2 / 3;
+      first = (cluster > 0) ? cluster - 1 : 0;
+      last = cluster + 1;
+    } else {
+      first = last = (index * sector_size + i) / (fat_type / 8);
     }
-  }
-  sprintf(path, "%s/%s", vvfat_path, VVFAT_ATTR);
-  vvfat_attr_fd = fopen(path, "w");
-  // parse new directory tree and create / modify directories and files
-  parse_directory(vvfat_path, (fat_type == 32) ? first_cluster_of_root_dir : 0);
-  if (vvfat_attr_fd != NULL) 
-    fclose(vvfat_attr_fd);
-  // remove all directories and files still marked for delete
-  for (i = this->mapping.next - 1; i > 0; i--) {
-    mapping = (mapping_t*)array_get(&this->mapping, i);
-    if (mapping->mode & MODE_DELETED) {
-      direntry_t* entry = (direntry_t*)array_get(&directory, mapping->dir_index);
-      if (entry->attributes == 0x10) {
-        bx_rmdir(mapping->path);
-      } else {
-        unlink(mapping->path);
-      }
+    for (cluster = first; (cluster <= last) && (cluster < cluster_count + 2); cluster++) {
+      dirty_clusters[cluster / 8] |= 1 << (cluster % 8);
+      if (dirty_fat[cluster / 8] & (1 << (cluster % 8)))
+        continue;
+      dirty_fat[cluster / 8] |= 1 << (cluster % 8);
+      mapping = find_mapping_for_cluster(cluster);
+      if (mapping != NULL)
+        mapping->fat_dirty = 1;
     }
   }
-  free(fat2);
+  memcpy(shadow, buf, sector_size);
 }
 
-void vvfat_image_t::close(void)
-{
-  char msg[BX_PATHNAME_LEN + 80];
-  mapping_t *mapping;
+/*
+ * Directory synchronization
+ *
+ * Every directory present on the host has a dirstate_t that holds its
+ * entries as of the last commit. A commit re-reads the FAT sectors the guest
+ * wrote, picks the directories with a cluster or FAT entry written since the
+ * last commit and compares their current entries with the saved ones. The
+ * differences are applied to the host as creates, renames / moves, deletes
+ * and file updates. Directories the guest did not touch are never read.
+ */
 
-  if (vvfat_modified) {
-    sprintf(msg, "Write back changes to directory '%s'?\n\nWARNING: This feature is still experimental!", vvfat_path);
-    //if (SIM->ask_yes_no("Bochs VVFAT modified", msg, 0)) {
-      commit_changes();
-    //}
-  }
-  array_free(&fat);
-  array_free(&directory);
-  for (unsigned i = 0; i < this->mapping.next; i++) {
-    mapping = (mapping_t*)array_get(&this->mapping, i);
-    free(mapping->path);
-  }
-  array_free(&this->mapping);
-  if (cluster_buffer != NULL)
-    delete [] cluster_buffer;
+static Bit32u direntry_begin(const direntry_t *entry)
+{
+  return dtoh16(entry->begin) | (dtoh16(entry->begin_hi) << 16);
+}
 
-  redolog->close();
+// entries with a cluster are matched by cluster, empty files by name
+static int diritem_compare(const diritem_t *a, const diritem_t *b)
+{
+  Bit32u ca = direntry_begin(&a->entry), cb = direntry_begin(&b->entry);
+
+  if (ca != cb)
+    return (ca < cb) ? -1 : 1;
+  if (ca != 0)
+    return 0;
+  return strcmp(a->name, b->name);
+}
+
+static int diritem_sort(const void *a, const void *b)
+{
+  return diritem_compare((const diritem_t*)a, (const diritem_t*)b);
+}
+
+static bx_bool direntry_changed(const direntry_t *a, const direntry_t *b)
+{
+  return (a->mdate != b->mdate) || (a->mtime != b->mtime) || (a->size != b->size);
+}
+
+// adds the directories among the mappings from first on
+void vvfat_image_t::init_dirstates(unsigned first)
+{
+  mapping_t *mapping;
+  dirstate_t *state;
+  int *index;
+  unsigned i;
+
+  index = (int*)malloc(this->mapping.next * sizeof(int));
+  for (i = 0; i < dirstates.next; i++) {
+    state = (dirstate_t*)array_get(&dirstates, i);
+    if (state->mapping_index >= 0)
+      index[state->mapping_index] = i;
+  }
+  for (i = first; i < this->mapping.next; i++) {
+    mapping = (mapping_t*)array_get(&this->mapping, i);
+    if (!(mapping->mode & MODE_DIRECTORY))
+      continue;
+    index[i] = dirstates.next;
+    state = (dirstate_t*)array_get_next(&dirstates);
+    memset(state, 0, sizeof(dirstate_t));
+    state->begin = mapping->begin;
+    state->mapping_index = i;
+    state->name = strdup(mapping->name);
+    state->parent = (i == 0) ? -1 : index[mapping->info.dir.parent_mapping_index];
+  }
+  free(index);
+  dirstate_sorted = 0;
+}
+
+void vvfat_image_t::sort_dirstates(void)
+{
+  dirstate_t *state;
+  unsigned i, j;
+  int k;
+
+  dirstate_order = (int*)realloc(dirstate_order, dirstates.next * sizeof(int));
+  // insertion sort: the table is sorted already except for the directories
+  // created since the last call
+  for (i = 0; i < dirstates.next; i++) {
+    state = (dirstate_t*)array_get(&dirstates, i);
+    k = i;
+    for (j = i; j > 0; j--) {
+      dirstate_t *prev = (dirstate_t*)array_get(&dirstates, dirstate_order[j - 1]);
+      if (prev->begin <= state->begin)
+        break;
+      dirstate_order[j] = dirstate_order[j - 1];
+    }
+    dirstate_order[j] = k;
+  }
+  dirstate_sorted = dirstates.next;
+}
+
+// returns the index of the directory starting at cluster begin, or -1
+int vvfat_image_t::find_dirstate(Bit32u begin)
+{
+  dirstate_t *state;
+  int low = 0, high = dirstate_sorted - 1, mid;
+  unsigned i;
+
+  while (low <= high) {
+    mid = (low + high) / 2;
+    state = (dirstate_t*)array_get(&dirstates, dirstate_order[mid]);
+    if (state->begin == begin)
+      return dirstate_order[mid];
+    if (state->begin < begin)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  for (i = dirstate_sorted; i < dirstates.next; i++) {
+    state = (dirstate_t*)array_get(&dirstates, i);
+    if (state->begin == begin)
+      return i;
+  }
+  return -1;
+}
+
+// 0 if the host path doesn't fit in BX_PATHNAME_LEN
+bx_bool vvfat_image_t::dirstate_path(int index, char *path)
+{
+  dirstate_t *state = (dirstate_t*)array_get(&dirstates, index);
+  char *name = state->name;
+
+  if (state->parent < 0)
+    return snprintf(path, BX_PATHNAME_LEN, "%s", name) < BX_PATHNAME_LEN;
+  if (!dirstate_path(state->parent, path))
+    return 0;
+  size_t len = strlen(path);
+  return snprintf(path + len, BX_PATHNAME_LEN - len, "/%s", name) < (int)(BX_PATHNAME_LEN - len);
+}
+
+// path/name into buf; a host path that doesn't fit is reported and skipped,
+// never used cut off
+static bx_bool join_path(char *buf, const char *path, const char *name)
+{
+  if (snprintf(buf, BX_PATHNAME_LEN, "%s/%s", path, name) >= BX_PATHNAME_LEN) {
+    printf("VVFAT: path too long: '%s/%s'\n", path, name);
+    return 0;
+  }
+  return 1;
+}
+
+// reads the current contents of a directory through the image
+Bit8u* vvfat_image_t::read_dir_clusters(Bit32u start_cluster, Bit32u *size)
+{
+  Bit32u csize, cur, next, count, rsvd_clusters;
+  Bit8u *buffer;
+
+  csize = sectors_per_cluster * sector_size;
+  rsvd_clusters = max_fat_value - 15;
+  if (start_cluster == 0) {
+    *size = root_entries * 32;
+    // zeroed tail entry terminates read_direntry() on a full directory
+    buffer = (Bit8u*)calloc(1, *size + 32);
+    lseek((Bit64s)offset_to_root_dir * sector_size, SEEK_SET);
+    read(buffer, *size);
+    return buffer;
+  }
+  *size = 0;
+  buffer = NULL;
+  next = start_cluster;
+  count = 0;
+  do {
+    cur = next;
+    if ((cur < 2) || (cur >= cluster_count + 2) || (count++ > cluster_count))
+      break;
+    buffer = (Bit8u*)realloc(buffer, *size + csize + 32);
+    lseek((Bit64s)cluster2sector(cur) * sector_size, SEEK_SET);
+    read(buffer + *size, csize);
+    *size += csize;
+    next = fat_get_next(cur);
+  } while (next < rsvd_clusters);
+  if (buffer == NULL)
+    buffer = (Bit8u*)malloc(32);
+  memset(buffer + *size, 0, 32);
+  return buffer;
+}
+
+// splits raw directory clusters into named entries; buffer needs a zeroed
+// tail entry and is modified by read_direntry()
+int vvfat_image_t::parse_dir_entries(Bit8u *buffer, Bit32u size, diritem_t **items)
+{
+  Bit8u *ptr = buffer;
+  direntry_t *entry;
+  diritem_t *item;
+  char filename[BX_PATHNAME_LEN];
+  int count = 0;
+
+  *items = NULL;
+  while ((Bit32u)(ptr - buffer) < size) {
+    entry = read_direntry(ptr, filename);
+    if (entry == NULL)
+      break;
+    *items = (diritem_t*)realloc(*items, (count + 1) * sizeof(diritem_t));
+    item = &(*items)[count++];
+    memcpy(&item->entry, entry, sizeof(direntry_t));
+    item->name = strdup(filename);
+    item->peer = -1;
+    item->peer_dir = -1;
+    ptr = (Bit8u*)entry + 32;
+  }
+  return count;
+}
+
+static void free_diritems(diritem_t *items, int count)
+{
+  for (int i = 0; i < count; i++)
+    free(items[i].name);
+  free(items);
+}
+
+// returns the entries of a directory as of the last commit
+int vvfat_image_t::dirstate_entries(dirstate_t *state, diritem_t **items)
+{
+  mapping_t *mapping;
+  Bit8u *buffer;
+  Bit32u size;
+  int count;
+
+  if (state->flags & DIRSTATE_NEW) {
+    *items = NULL;
+    return 0;
+  }
+  if (state->entries != NULL) {
+    size = state->size;
+    buffer = (Bit8u*)malloc(size + 32);
+    memcpy(buffer, state->entries, size + 32);
+  } else {
+    // never modified: still the contents built by init_directories(), or
+    // by populate_lazy_dir(), which adds dirstates
+    mapping = (mapping_t*)array_get(&this->mapping, state->mapping_index);
+    if (mapping->mode & MODE_LAZY) {
+      materialize_clusters(mapping->begin, mapping->begin + 1);
+      mapping = (mapping_t*)array_get(&this->mapping, state->mapping_index);
+    }
+    if (mapping->begin == 0) {
+      size = root_entries * 32;
+    } else {
+      size = (mapping->end - mapping->begin) * cluster_size;
+    }
+    if (size > (directory.next - mapping->info.dir.first_dir_index) * 32)
+      size = (directory.next - mapping->info.dir.first_dir_index) * 32;
+    buffer = (Bit8u*)calloc(1, size + 32);
+    memcpy(buffer, array_get(&directory, mapping->info.dir.first_dir_index), size);
+  }
+  count = parse_dir_entries(buffer, size, items);
+  free(buffer);
+  return count;
+}
+
+bx_bool vvfat_image_t::dirstate_dirty(dirstate_t *state)
+{
+  Bit32u cluster, count = 0;
+
+  if (state->begin == 0)
+    return dirty_clusters[0] & 1;
+  for (cluster = state->begin; (cluster >= 2) && (cluster < cluster_count + 2) &&
+       (count++ <= cluster_count); cluster = fat_get_next(cluster)) {
+    if (dirty_clusters[cluster / 8] & (1 << (cluster % 8)))
+      return 1;
+  }
+  return 0;
+}
+
+// Compares the current entries of a modified directory with the saved ones.
+// Unmatched entries are either new or removed, unless match_moves() pairs
+// them up across directories.
+void vvfat_image_t::diff_directory(int index)
+{
+  dirstate_t *state = (dirstate_t*)array_get(&dirstates, index);
+  dirstate_t *child;
+  diritem_t *old_items, *new_items, *item, *old;
+  Bit8u *buffer;
+  Bit32u begin;
+  int i, old_count, new_count, child_index;
+
+  state->new_entries = read_dir_clusters(state->begin, &state->new_size);
+  // parse a copy, read_direntry() modifies the buffer
+  buffer = (Bit8u*)malloc(state->new_size + 32);
+  memcpy(buffer, state->new_entries, state->new_size + 32);
+  new_count = parse_dir_entries(buffer, state->new_size, &new_items);
+  free(buffer);
+  old_count = dirstate_entries(state, &old_items);
+  qsort(old_items, old_count, sizeof(diritem_t), diritem_sort);
+  state->new_items = new_items;
+  state->new_count = new_count;
+  state->old_items = old_items;
+  state->old_count = old_count;
+
+  for (i = 0; i < new_count; i++) {
+    item = &new_items[i];
+    old = (diritem_t*)bsearch(item, old_items, old_count, sizeof(diritem_t),
+                              diritem_sort);
+    if ((old != NULL) && (old->peer < 0)) {
+      old->peer = i;
+      item->peer = old - old_items;
+      if (strcmp(old->name, item->name) || (old->entry.attributes != item->entry.attributes))
+        attributes_changed = 1;
+      continue;
+    }
+    if ((item->entry.attributes != 0x10) && (item->entry.attributes != 0x20))
+      attributes_changed = 1;
+    begin = direntry_begin(&item->entry);
+    if (!(item->entry.attributes & 0x10) || (begin < 2))
+      continue;
+    child_index = find_dirstate(begin);
+    if (child_index >= 0) {
+      // a directory keeps its clusters when it is moved
+      child = (dirstate_t*)array_get(&dirstates, child_index);
+      child->flags |= DIRSTATE_MOVED;
+    } else {
+      // may move the dirstates array
+      child = (dirstate_t*)array_get_next(&dirstates);
+      if (child == NULL)
+        continue;
+      memset(child, 0, sizeof(dirstate_t));
+      child->begin = begin;
+      child->parent = index;
+      child->name = strdup(item->name);
+      child->mapping_index = -1;
+      child->flags = DIRSTATE_NEW | DIRSTATE_MODIFIED;
+    }
+  }
+  for (i = 0; i < old_count; i++) {
+    old = &old_items[i];
+    if ((old->peer < 0) && (old->entry.attributes != 0x10) && (old->entry.attributes != 0x20))
+      attributes_changed = 1;
+  }
+}
+
+// pairs files removed from one modified directory with files added to
+// another; as before, the creation time tells a move from a reused cluster
+void vvfat_image_t::match_moves(void)
+{
+  dirstate_t *state, *src;
+  diritem_t *item, *old;
+  unsigned i, j;
+  int k;
+
+  for (i = 0; i < dirstates.next; i++) {
+    state = (dirstate_t*)array_get(&dirstates, i);
+    if (!(state->flags & DIRSTATE_MODIFIED))
+      continue;
+    for (k = 0; k < state->new_count; k++) {
+      item = &state->new_items[k];
+      if ((item->peer >= 0) || (item->entry.attributes & 0x10) ||
+          (direntry_begin(&item->entry) == 0))
+        continue;
+      for (j = 0; (j < dirstates.next) && (item->peer < 0); j++) {
+        src = (dirstate_t*)array_get(&dirstates, j);
+        if ((j == i) || !(src->flags & DIRSTATE_MODIFIED))
+          continue;
+        old = (diritem_t*)bsearch(item, src->old_items, src->old_count,
+                                  sizeof(diritem_t), diritem_sort);
+        if ((old != NULL) && (old->peer < 0) &&
+            (old->entry.cdate == item->entry.cdate) &&
+            (old->entry.ctime == item->entry.ctime)) {
+          old->peer = k;
+          old->peer_dir = i;
+          item->peer = old - src->old_items;
+          item->peer_dir = j;
+        }
+      }
+    }
+  }
+}
+
+// updates the paths of the mappings at or below a renamed file / directory.
+// The mapping of oldpath itself moves to the mapping of the new parent
+// directory and takes the new name; the ones below it follow by their parent
+// index. If the new directory has no mapping, the full path is kept instead.
+void vvfat_image_t::rename_mapping_paths(const char *oldpath, const char *newpath)
+{
+  mapping_t *mapping, *parent = NULL;
+  size_t len = strlen(oldpath);
+  const char *name = strrchr(newpath, '/');
+  char path[BX_PATHNAME_LEN];
+
+  if (name != NULL) {
+    for (unsigned i = 0; i < this->mapping.next; i++) {
+      mapping = (mapping_t*)array_get(&this->mapping, i);
+      if ((mapping->mode & MODE_DIRECTORY) &&
+          mapping_has_path(mapping, newpath, name - newpath)) {
+        parent = mapping;
+        break;
+      }
+    }
+  }
+  for (unsigned i = 1; i < this->mapping.next; i++) {
+    mapping = (mapping_t*)array_get(&this->mapping, i);
+    if (mapping_has_path(mapping, oldpath, len)) {
+      if (parent != NULL) {
+        mapping->name = name_arena_strdup(&names, name + 1);
+        mapping->parent = parent - (mapping_t*)this->mapping.pointer;
+      } else {
+        mapping->name = name_arena_strdup(&names, newpath);
+        mapping->parent = -1;
+      }
+    } else if ((mapping->parent < 0) && !strncmp(mapping->name, oldpath, len) &&
+               (mapping->name[len] == '/')) {
+      // below a directory that had no mapping either
+      snprintf(path, BX_PATHNAME_LEN, "%s%s", newpath, mapping->name + len);
+      mapping->name = name_arena_strdup(&names, path);
+    }
+  }
+}
+
+void vvfat_image_t::rename_path(const char *oldpath, const char *newpath)
+{
+  if (rename(oldpath, newpath) < 0) {
+    printf("VVFAT: could not rename '%s' to '%s'\n", oldpath, newpath);
+    return;
+  }
+  rename_mapping_paths(oldpath, newpath);
+}
+
+void vvfat_image_t::update_file(const char *path, direntry_t *entry, direntry_t *old)
+{
+  mapping_t *mapping;
+  Bit32u begin = direntry_begin(entry);
+
+  if (!direntry_changed(entry, old))
+    return;
+  if ((entry->size == old->size) && (begin >= 2)) {
+    mapping = find_mapping_for_cluster(begin);
+    if ((mapping != NULL) && (mapping->begin == begin) &&
+        (mapping->mode == MODE_NORMAL) && write_through_possible(mapping)) {
+      // the data is already in place
+      set_file_times(path, entry);
+      return;
+    }
+  }
+  write_file(path, entry, 0);
+}
+
+// Deletes a host file the guest removed. What was written through to it
+// goes to the redolog first, its clusters may belong to another file by now.
+void vvfat_image_t::remove_file(const char *path, const direntry_t *entry)
+{
+  mapping_t *mapping = find_mapping_for_cluster(direntry_begin(entry));
+
+  if ((mapping != NULL) && mapping->written_through)
+    retire_mapping(path);
+  unlink(path);
+}
+
+// applies the changes of a modified directory, then descends into the
+// directories below it that contain changes
+void vvfat_image_t::sync_directory(int index)
+{
+  dirstate_t *state, *child;
+  diritem_t *item, *old;
+  char path[BX_PATHNAME_LEN];
+  char dir_path[BX_PATHNAME_LEN];
+  char src_path[BX_PATHNAME_LEN];
+  char full_path[BX_PATHNAME_LEN];
+  int i, child_index;
+
+  state = (dirstate_t*)array_get(&dirstates, index);
+  if (!(state->flags & DIRSTATE_MODIFIED)) {
+    // only on the way to a modified directory
+    for (i = 0; i < (int)dirstates.next; i++) {
+      child = (dirstate_t*)array_get(&dirstates, i);
+      if ((child->parent == index) && !(child->flags & (DIRSTATE_REMOVED | DIRSTATE_GONE)) &&
+          (child->flags & (DIRSTATE_MODIFIED | DIRSTATE_SUBTREE))) {
+        sync_directory(i);
+      }
+    }
+    return;
+  }
+  if (!dirstate_path(index, path)) {
+    printf("VVFAT: path too long below '%s'\n", path);
+    return;
+  }
+  for (i = 0; i < state->new_count; i++) {
+    state = (dirstate_t*)array_get(&dirstates, index);
+    item = &state->new_items[i];
+    if (!join_path(full_path, path, item->name))
+      continue;
+    if (item->entry.attributes & 0x10) {
+      child_index = find_dirstate(direntry_begin(&item->entry));
+      if (child_index < 0)
+        continue;
+      child = (dirstate_t*)array_get(&dirstates, child_index);
+      if (child->flags & DIRSTATE_NEW) {
+        bx_mkdir(full_path);
+      } else {
+        if (!dirstate_path(child_index, src_path))
+          continue;
+        if (strcmp(src_path, full_path)) {
+          rename_path(src_path, full_path);
+        }
+        child = (dirstate_t*)array_get(&dirstates, child_index);
+        free(child->name);
+        child->name = strdup(item->name);
+        child->parent = index;
+        child->flags &= ~DIRSTATE_MOVED;
+      }
+      if (child->flags & (DIRSTATE_MODIFIED | DIRSTATE_SUBTREE)) {
+        sync_directory(child_index);
+      }
+    } else if (item->peer < 0) {
+      write_file(full_path, &item->entry, 1);
+    } else {
+      if (item->peer_dir < 0) {
+        old = &state->old_items[item->peer];
+        if (!join_path(src_path, path, old->name))
+          continue;
+      } else {
+        dirstate_t *src = (dirstate_t*)array_get(&dirstates, item->peer_dir);
+        old = &src->old_items[item->peer];
+        if (!dirstate_path(item->peer_dir, dir_path) ||
+            !join_path(src_path, dir_path, old->name))
+          continue;
+      }
+      if (strcmp(src_path, full_path)) {
+        rename_path(src_path, full_path);
+      }
+      update_file(full_path, &item->entry, &old->entry);
+    }
+  }
+}
+
+// removes what is left of a directory the guest deleted
+void vvfat_image_t::remove_directory(int index)
+{
+  dirstate_t *state, *child;
+  diritem_t *items;
+  char path[BX_PATHNAME_LEN];
+  char full_path[BX_PATHNAME_LEN];
+  int i, count;
+
+  state = (dirstate_t*)array_get(&dirstates, index);
+  if (!dirstate_path(index, path)) {
+    printf("VVFAT: path too long below '%s'\n", path);
+    state->flags |= DIRSTATE_GONE;
+    return;
+  }
+  count = dirstate_entries(state, &items);
+  for (i = 0; i < count; i++) {
+    if (!(items[i].entry.attributes & 0x10) && join_path(full_path, path, items[i].name)) {
+      remove_file(full_path, &items[i].entry);
+    }
+  }
+  free_diritems(items, count);
+  // directories moved out have a new parent already
+  for (i = 0; i < (int)dirstates.next; i++) {
+    child = (dirstate_t*)array_get(&dirstates, i);
+    if ((child->parent == index) && !(child->flags & DIRSTATE_GONE)) {
+      remove_directory(i);
+    }
+  }
+  bx_rmdir(path);
+  state = (dirstate_t*)array_get(&dirstates, index);
+  state->flags |= DIRSTATE_GONE;
+}
+
+void vvfat_image_t::save_dirstate_attributes(void)
+{
+  dirstate_t *state;
+  diritem_t *items;
+  mapping_t *mapping;
+  lazy_dir_t *lazy;
+  char path[BX_PATHNAME_LEN];
+  char full_path[BX_PATHNAME_LEN];
+  char *old_lines = NULL, *line, *next, *name;
+  size_t len;
+  long size;
+  int count;
+  FILE *fd;
+
+  sprintf(path, "%s/%s", vvfat_path, VVFAT_ATTR);
+  // the lines for lazy subtrees not populated yet are kept as they are
+  if ((lazy_pending > 0) && ((fd = fopen(path, "r")) != NULL)) {
+    fseek(fd, 0, SEEK_END);
+    size = ftell(fd);
+    rewind(fd);
+    old_lines = (char*)malloc(size + 1);
+    size = fread(old_lines, 1, size, fd);
+    old_lines[(size > 0) ? size : 0] = '\0';
+    fclose(fd);
+  }
+  vvfat_attr_fd = fopen(path, "w");
+  if (vvfat_attr_fd == NULL) {
+    free(old_lines);
+    return;
+  }
+  for (unsigned i = 0; i < dirstates.next; i++) {
+    state = (dirstate_t*)array_get(&dirstates, i);
+    if (state->flags & DIRSTATE_GONE)
+      continue;
+    if ((state->mapping_index >= 0) &&
+        (((mapping_t*)array_get(&this->mapping, state->mapping_index))->mode & MODE_LAZY))
+      continue;
+    if (!dirstate_path(i, path))
+      continue;
+    count = dirstate_entries(state, &items);
+    for (int j = 0; j < count; j++) {
+      if (join_path(full_path, path, items[j].name))
+        save_attributes(full_path, &items[j].entry);
+    }
+    free_diritems(items, count);
+  }
+  for (line = old_lines; (line != NULL) && (*line != '\0'); line = next) {
+    next = line + strcspn(line, "\n");
+    if (*next != '\0')
+      *next++ = '\0';
+    name = line + (line[0] == '"');
+    len = strcspn(name, ":");
+    if ((len > 0) && (name[len - 1] == '"'))
+      len--;
+    snprintf(full_path, BX_PATHNAME_LEN, "%s/%.*s", vvfat_path, (int)len, name);
+    for (unsigned i = 0; i < lazy_dirs.next; i++) {
+      lazy = (lazy_dir_t*)array_get(&lazy_dirs, i);
+      if (!lazy->pending)
+        continue;
+      mapping = (mapping_t*)array_get(&this->mapping, lazy->mapping_index);
+      mapping_path(mapping, path);
+      len = strlen(path);
+      if (!strncmp(full_path, path, len) && (full_path[len] == '/')) {
+        fprintf(vvfat_attr_fd, "%s\n", line);
+        break;
+      }
+    }
+  }
+  free(old_lines);
+  fclose(vvfat_attr_fd);
+  vvfat_attr_fd = NULL;
+}
+
+void vvfat_image_t::commit_changes(void)
+{
+  dirstate_t *state, *parent, *child;
+  diritem_t *old;
+  char path[BX_PATHNAME_LEN];
+  char full_path[BX_PATHNAME_LEN];
+  unsigned i;
+  int j, child_index;
+
+  for (i = 0; i < dirstates.next; i++) {
+    state = (dirstate_t*)array_get(&dirstates, i);
+    if (!(state->flags & DIRSTATE_GONE) && dirstate_dirty(state)) {
+      state->flags |= DIRSTATE_MODIFIED;
+      for (j = state->parent; j >= 0; j = parent->parent) {
+        parent = (dirstate_t*)array_get(&dirstates, j);
+        if (parent->flags & DIRSTATE_SUBTREE)
+          break;
+        parent->flags |= DIRSTATE_SUBTREE;
+      }
+    }
+  }
+  state = (dirstate_t*)array_get(&dirstates, 0);
+  if (state->flags & (DIRSTATE_MODIFIED | DIRSTATE_SUBTREE)) {
+    attributes_changed = 0;
+    sort_dirstates();
+    // directories found while diffing are appended and diffed as well
+    for (i = 0; i < dirstates.next; i++) {
+      state = (dirstate_t*)array_get(&dirstates, i);
+      if (state->flags & DIRSTATE_MODIFIED) {
+        diff_directory(i);
+      }
+    }
+    sort_dirstates();
+    match_moves();
+
+    // delete removed files first, a new file may take over the name; removed
+    // directories are only set aside, something may still be moved out
+    for (i = 0; i < dirstates.next; i++) {
+      state = (dirstate_t*)array_get(&dirstates, i);
+      if (!(state->flags & DIRSTATE_MODIFIED))
+        continue;
+      if (!dirstate_path(i, path))
+        continue;
+      for (j = 0; j < state->old_count; j++) {
+        state = (dirstate_t*)array_get(&dirstates, i);
+        old = &state->old_items[j];
+        if ((old->peer >= 0) || !join_path(full_path, path, old->name))
+          continue;
+        if (old->entry.attributes & 0x10) {
+          child_index = find_dirstate(direntry_begin(&old->entry));
+          if (child_index < 0)
+            continue;
+          child = (dirstate_t*)array_get(&dirstates, child_index);
+          if (child->flags & DIRSTATE_MOVED)
+            continue;
+          child->flags |= DIRSTATE_REMOVED;
+          free(child->name);
+          child->name = (char*)malloc(32);
+          sprintf(child->name, ".vvfat_removed.%d", child_index);
+          if (dirstate_path(child_index, path))
+            rename_path(full_path, path);
+          dirstate_path(i, path);
+        } else {
+          remove_file(full_path, &old->entry);
+        }
+      }
+    }
+
+    sync_directory(0);
+
+    for (i = 0; i < dirstates.next; i++) {
+      state = (dirstate_t*)array_get(&dirstates, i);
+      if ((state->flags & DIRSTATE_REMOVED) && !(state->flags & DIRSTATE_GONE)) {
+        remove_directory(i);
+      }
+    }
+    // the current entries become the reference for the next commit
+    for (i = 0; i < dirstates.next; i++) {
+      state = (dirstate_t*)array_get(&dirstates, i);
+      if (state->flags & DIRSTATE_MODIFIED) {
+        free(state->entries);
+        state->entries = state->new_entries;
+        state->size = state->new_size;
+        state->new_entries = NULL;
+        free_diritems(state->new_items, state->new_count);
+        free_diritems(state->old_items, state->old_count);
+        state->new_items = state->old_items = NULL;
+        state->new_count = state->old_count = 0;
+      }
+      if (state->flags & DIRSTATE_GONE) {
+        free(state->entries);
+        state->entries = NULL;
+        // never found again
+        state->begin = 0xffffffff;
+      }
+      state->flags &= ~(DIRSTATE_MODIFIED | DIRSTATE_SUBTREE | DIRSTATE_NEW |
+                        DIRSTATE_MOVED | DIRSTATE_REMOVED);
+    }
+    sort_dirstates();
+    if (attributes_changed) {
+      save_dirstate_attributes();
+    }
+  }
+  memset(dirty_clusters, 0, (cluster_count + 2 + 7) / 8);
+  vvfat_modified = 0;
+}
+
+void vvfat_image_t::close(void)
+{
+  char msg[BX_PATHNAME_LEN + 80];
+
+  if (vvfat_modified) {
+    sprintf(msg, "Write back changes to directory '%s'?\n\nWARNING: This feature is still experimental!", vvfat_path);
+    //if (SIM->ask_yes_no("Bochs VVFAT modified", msg, 0)) {
+      commit_changes();
+    //}
+  }
+  if (write_through_fd >= 0) {
+    ::close(write_through_fd);
+    write_through_fd = -1;
+  }
+  if (lazy_pending < lazy_dirs.next)
+    save_lazy_estimates();
+  array_free(&lazy_dirs);
+  array_init(&lazy_dirs, sizeof(lazy_dir_t));
+  lazy_pending = 0;
+  array_free(&fat);
+  array_free(&directory);
+  array_free(&this->mapping);
+  name_arena_free(&names);
+  shortname_table_free(&shortnames);
+  free(dirent_buffer);
+  dirent_buffer = NULL;
+  array_free(&dirscan);
+  array_init(&dirscan, sizeof(dirscan_t));
+  stat_ring_close(stat_ring);
+  stat_ring = NULL;
+  free(mapping_begin);
+  free(mapping_order);
+  free(mapping_begin_top);
+  mapping_begin = mapping_order = mapping_begin_top = NULL;
+  mapping_top_count = 0;
+  if (cluster_buffer != NULL)
+    delete [] cluster_buffer;
+  if (dirty_fat != NULL)
+    delete [] dirty_fat;
+  if (dirty_clusters != NULL)
+    delete [] dirty_clusters;
+  if (fat2 != NULL)
+    free(fat2);
+  for (unsigned i = 0; i < dirstates.next; i++) {
+    dirstate_t *state = (dirstate_t*)array_get(&dirstates, i);
+    free(state->name);
+    free(state->entries);
+  }
+  array_free(&dirstates);
+  free(dirstate_order);
+
+  redolog->close();
 
   if (redolog_temp!=NULL)
     free(redolog_temp);
@@ -2137,9 +3922,9 @@ Bit64s vvfat_image_t::lseek(Bit64s offset, int whence)
 {
   redolog->lseek(offset, whence);
   if (whence == SEEK_SET) {
-    sector_num = (Bit32u)(offset / 512);
+    sector_num = (Bit32u)(offset / sector_size);
   } else if (whence == SEEK_CUR) {
-    sector_num += (Bit32u)(offset / 512);
+    sector_num += (Bit32u)(offset / sector_size);
   } else {
     printf("lseek: mode not supported yet\n");
     return -1;
@@ -2161,65 +3946,133 @@ void vvfat_image_t::close_current_file(void)
   current_cluster = 0xffff;
 }
 
-// mappings between index1 and index2-1 are supposed to be ordered
-// return value is the index of the last mapping for which end>cluster_num
-int vvfat_image_t::find_mapping_for_cluster_aux(int cluster_num, int index1, int index2)
-{
-  while(1) {
-    int index3;
-    mapping_t* mapping;
-    index3 = (index1+index2) / 2;
-    mapping = (mapping_t*)array_get(&this->mapping, index3);
-    assert(mapping->begin < mapping->end);
-    if (mapping->begin >= (unsigned int)cluster_num) {
-      assert(index2 != index3 || index2 == 0);
-      if (index2 == index3)
-        return index1;
-      index2 = index3;
-    } else {
-      if (index1 == index3)
-        return (mapping->end <= (unsigned int)cluster_num) ? index2 : index1;
-      index1 = index3;
-    }
-    assert(index1 <= index2);
+static int mapping_begin_compare(const void *a, const void *b)
+{
+  Bit64u ka = *(const Bit64u*)a, kb = *(const Bit64u*)b;
+
+  return (ka < kb) ? -1 : (ka > kb);
+}
+
+// init_directories() lays the mappings out in cluster order, but lazy
+// subtrees append theirs later on. The begin clusters in cluster order are
+// copied into a dense array, and every MAPPING_INDEX_STRIDE'th of those into
+// a top level small enough to stay in cache, so a lookup touches the top
+// level, one stride of begins and then the one mapping it returns.
+void vvfat_image_t::index_mappings(void)
+{
+  unsigned i, count = this->mapping.next;
+  Bit64u *keys;
+  bx_bool sorted = 1;
+
+  free(mapping_begin);
+  free(mapping_order);
+  free(mapping_begin_top);
+  mapping_top_count = (count + MAPPING_INDEX_STRIDE - 1) / MAPPING_INDEX_STRIDE;
+  mapping_begin = (Bit32u*)malloc((count + 1) * sizeof(Bit32u));
+  mapping_order = (Bit32u*)malloc((count + 1) * sizeof(Bit32u));
+  mapping_begin_top = (Bit32u*)malloc((mapping_top_count + 1) * sizeof(Bit32u));
+  // begin and index in one key, sorted if the mappings aren't in order
+  keys = (Bit64u*)malloc((count + 1) * sizeof(Bit64u));
+  for (i = 0; i < count; i++) {
+    keys[i] = ((Bit64u)((mapping_t*)array_get(&this->mapping, i))->begin << 32) | i;
+    if ((i > 0) && (keys[i] < keys[i - 1]))
+      sorted = 0;
   }
+  if (!sorted)
+    qsort(keys, count, sizeof(Bit64u), mapping_begin_compare);
+  for (i = 0; i < count; i++) {
+    mapping_begin[i] = (Bit32u)(keys[i] >> 32);
+    mapping_order[i] = (Bit32u)keys[i];
+    assert((i == 0) || (mapping_begin[i] > mapping_begin[i - 1]));
+    if ((i % MAPPING_INDEX_STRIDE) == 0)
+      mapping_begin_top[i / MAPPING_INDEX_STRIDE] = mapping_begin[i];
+  }
+  free(keys);
 }
 
 mapping_t* vvfat_image_t::find_mapping_for_cluster(int cluster_num)
 {
-  int index = find_mapping_for_cluster_aux(cluster_num, 0, mapping.next);
+  unsigned low = 0, high = mapping_top_count, mid, index, last;
   mapping_t* mapping;
-  if (index >= (int)this->mapping.next)
+
+  // the first stride that begins after cluster_num
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (mapping_begin_top[mid] <= (Bit32u)cluster_num)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low == 0)
     return NULL;
-  mapping = (mapping_t*)array_get(&this->mapping, index);
-  if ((int)mapping->begin > cluster_num)
+  // the last mapping of the stride before it that begins at or before it
+  index = (low - 1) * MAPPING_INDEX_STRIDE;
+  last = index + MAPPING_INDEX_STRIDE;
+  if (last > this->mapping.next)
+    last = this->mapping.next;
+  while ((index + 1 < last) && (mapping_begin[index + 1] <= (Bit32u)cluster_num))
+    index++;
+  mapping = (mapping_t*)array_get(&this->mapping, mapping_order[index]);
+  if ((int)mapping->end <= cluster_num)
     return NULL;
-  assert(((int)mapping->begin <= cluster_num) && ((int)mapping->end > cluster_num));
   return mapping;
 }
 
-// This function simply compares path == mapping->path. Since the mappings
-// are sorted by cluster, this is expensive: O(n).
+// This function simply compares path with the path of each mapping. Since
+// the mappings are sorted by cluster, this is expensive: O(n).
 mapping_t* vvfat_image_t::find_mapping_for_path(const char* path)
 {
     int i;
+    size_t len = strlen(path);
 
     for (i = 0; i < (int)this->mapping.next; i++) {
       mapping_t* mapping = (mapping_t*)array_get(&this->mapping, i);
-      if ((mapping->first_mapping_index < 0) && !strcmp(path, mapping->path))
+      if ((mapping->first_mapping_index < 0) && mapping_has_path(mapping, path, len))
         return mapping;
     }
     return NULL;
 }
 
+// builds the full path of a mapping from the names up to the root
+void vvfat_image_t::mapping_path(const mapping_t *mapping, char *path)
+{
+  size_t len;
+
+  if (mapping->parent < 0) {
+    snprintf(path, BX_PATHNAME_LEN, "%s", mapping->name);
+  } else {
+    mapping_path((mapping_t*)array_get(&this->mapping, mapping->parent), path);
+    len = strlen(path);
+    snprintf(path + len, BX_PATHNAME_LEN - len, "/%s", mapping->name);
+  }
+}
+
+// whether the first len bytes of path are the full path of a mapping;
+// compares the names from the last one up without building the path
+bx_bool vvfat_image_t::mapping_has_path(const mapping_t *mapping, const char *path, size_t len)
+{
+  size_t name_len = strlen(mapping->name);
+
+  if (mapping->parent < 0)
+    return (name_len == len) && !memcmp(mapping->name, path, len);
+  if ((name_len >= len) || (path[len - name_len - 1] != '/') ||
+      memcmp(path + len - name_len, mapping->name, name_len))
+    return 0;
+  return mapping_has_path((mapping_t*)array_get(&this->mapping, mapping->parent),
+                          path, len - name_len - 1);
+}
+
 int vvfat_image_t::open_file(mapping_t* mapping)
 {
   if (!mapping)
     return -1;
-  if (!current_mapping ||
-    strcmp(current_mapping->path, mapping->path)) {
+  if (!current_mapping || (current_mapping->parent != mapping->parent) ||
+    strcmp(current_mapping->name, mapping->name)) {
+    char path[BX_PATHNAME_LEN];
+
     /* open file */
-    int fd = ::open(mapping->path, O_RDONLY
+    mapping_path(mapping, path);
+    int fd = ::open(path, O_RDONLY
 #ifdef O_BINARY
                     | O_BINARY
 #endif
@@ -2281,85 +4134,385 @@ read_cluster_directory:
       current_cluster = 0xffff;
       return -1;
     }
+    // past the end of the file, don't hand out what the buffer held before
+    if (result < (int)cluster_size)
+      memset(cluster + result, 0, cluster_size - result);
     current_cluster = cluster_num;
   }
   return 0;
 }
 
+// the in-memory copy of a sector before the data area
+const Bit8u *vvfat_image_t::meta_sector(Bit32u sector)
+{
+  if (sector < (offset_to_bootsector + reserved_sectors))
+    return &first_sectors[sector * sector_size];
+  else if ((sector - offset_to_fat) < sectors_per_fat)
+    return (Bit8u*)&fat.pointer[(sector - offset_to_fat) * sector_size];
+  else if ((sector - offset_to_fat - sectors_per_fat) < sectors_per_fat)
+    return (Bit8u*)&fat.pointer[(sector - offset_to_fat - sectors_per_fat) * sector_size];
+  else
+    return (Bit8u*)&directory.pointer[(sector - offset_to_root_dir) * sector_size];
+}
+
 ssize_t vvfat_image_t::read(void* buf, size_t count)
 {
   char *cbuf = (char*)buf;
-  Bit32u scount = (Bit32u)(count / 0x200);
+  Bit32u scount = (Bit32u)(count / sector_size);
 
+  materialize(sector_num, scount);
   while (scount-- > 0) {
-    if ((ssize_t)redolog->read(cbuf, 0x200) != 0x200) {
+    if ((ssize_t)redolog->read(cbuf, sector_size) != sector_size) {
       if (sector_num < offset_to_data) {
-        if (sector_num < (offset_to_bootsector + reserved_sectors))
-          memcpy(cbuf, &first_sectors[sector_num * 0x200], 0x200);
-        else if ((sector_num - offset_to_fat) < sectors_per_fat)
-          memcpy(cbuf, &fat.pointer[(sector_num - offset_to_fat) * 0x200], 0x200);
-        else if ((sector_num - offset_to_fat - sectors_per_fat) < sectors_per_fat)
-          memcpy(cbuf, &fat.pointer[(sector_num - offset_to_fat - sectors_per_fat) * 0x200], 0x200);
-        else
-          memcpy(cbuf, &directory.pointer[(sector_num - offset_to_root_dir) * 0x200], 0x200);
+        memcpy(cbuf, meta_sector(sector_num), sector_size);
       } else {
         Bit32u sector = sector_num - offset_to_data,
         sector_offset_in_cluster = (sector % sectors_per_cluster),
         cluster_num = sector / sectors_per_cluster + 2;
         if (read_cluster(cluster_num) != 0) {
-          memset(cbuf, 0, 0x200);
+          memset(cbuf, 0, sector_size);
         } else {
-          memcpy(cbuf, cluster + sector_offset_in_cluster * 0x200, 0x200);
+          memcpy(cbuf, cluster + sector_offset_in_cluster * sector_size, sector_size);
         }
       }
-      redolog->lseek((sector_num + 1) * 0x200, SEEK_SET);
+      redolog->lseek((Bit64s)(sector_num + 1) * sector_size, SEEK_SET);
     }
     sector_num++;
-    cbuf += 0x200;
+    cbuf += sector_size;
   }
   return count;
 }
 
+// Returns a descriptor of the host file that holds the next count bytes
+// if they can be sent straight from it: data of one file, none of it in the
+// redolog. The caller closes the descriptor. Advances the position like
+// read() does; on failure (-1) the position is unchanged.
+int vvfat_image_t::map_read(size_t count, off_t *offset)
+{
+  Bit32u cluster_num, last_cluster;
+  mapping_t *mapping;
+  int fd;
+
+  if ((count == 0) || (sector_num < offset_to_data))
+    return -1;
+  cluster_num = sector2cluster(sector_num);
+  last_cluster = sector2cluster(sector_num + (Bit32u)(count / sector_size) - 1);
+  if (last_cluster >= cluster_count + 2)
+    return -1;
+  mapping = find_mapping_for_cluster(cluster_num);
+  if ((mapping == NULL) || (mapping->mode != MODE_NORMAL) ||
+      (last_cluster >= mapping->end))
+    return -1;
+  if (redolog->contains((Bit64s)sector_num * sector_size, count))
+    return -1;
+  if (open_file(mapping))
+    return -1;
+  fd = dup(current_fd);
+  if (fd < 0)
+    return -1;
+  *offset = cluster_size * (cluster_num - mapping->begin) + mapping->info.file.offset
+            + ((sector_num - offset_to_data) % sectors_per_cluster) * sector_size;
+  lseek((Bit64s)(sector_num + count / sector_size) * sector_size, SEEK_SET);
+  return fd;
+}
+
+static bx_bool is_zero_sector(const Bit8u *data, Bit32u size)
+{
+  const Bit64u *word = (const Bit64u*)data;
+
+  for (Bit32u i = 0; i < size / 8; i++) {
+    if (word[i] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Returns how many sectors from sector on (at least one, at most limit) are
+// all data or all hole. In the data area the answer covers the rest of a
+// cluster at most; a cluster the guest wrote to is data as a whole.
+Bit32u vvfat_image_t::classify_sectors(Bit32u sector, Bit32u limit, bx_bool *hole)
+{
+  Bit32u cluster_num, in_cluster, run, size, offset;
+  mapping_t *mapping;
+  direntry_t *entry;
+
+  if (sector < offset_to_data) {
+    *hole = !redolog->contains((Bit64s)sector * sector_size, sector_size) &&
+            is_zero_sector(meta_sector(sector), sector_size);
+    return 1;
+  }
+  cluster_num = sector2cluster(sector);
+  in_cluster = (sector - offset_to_data) % sectors_per_cluster;
+  run = sectors_per_cluster - in_cluster;
+  if (run > limit)
+    run = limit;
+  *hole = 0;
+  if (redolog->contains((Bit64s)sector * sector_size, (Bit64s)run * sector_size))
+    return run;
+  mapping = (cluster_num < cluster_count + 2) ? find_mapping_for_cluster(cluster_num) : NULL;
+  if (mapping == NULL) {
+    *hole = 1;
+    return run;
+  }
+  if (mapping->mode & MODE_DIRECTORY) {
+    *hole = is_zero_sector((Bit8u*)directory.pointer
+                           + cluster_size * (cluster_num - mapping->begin)
+                           + 0x20 * mapping->info.dir.first_dir_index + in_cluster * sector_size,
+                           sector_size);
+    return 1;
+  }
+  entry = (direntry_t*)array_get(&directory, mapping->dir_index);
+  size = dtoh32(entry->size);
+  offset = cluster_size * (cluster_num - mapping->begin) + mapping->info.file.offset
+           + in_cluster * sector_size;
+  if (offset >= size) {
+    *hole = 1;
+    return run;
+  }
+  // up to the sector holding the end of the file
+  if ((size - offset + (sector_size - 1)) / sector_size < run)
+    run = (size - offset + (sector_size - 1)) / sector_size;
+  return run;
+}
+
+// Splits the next count bytes into data and holes for NBD block status. A
+// hole reads as zeros and nothing backs it: free clusters, what follows the
+// end of a file in its last cluster, and all-zero sectors of the tables kept
+// in memory (FAT beyond the last cluster, unused directory entries). Returns
+// the number of extents, at most max, which may end short of count. The
+// position is not moved.
+int vvfat_image_t::get_extents(size_t count, vvfat_extent_t *extents, int max)
+{
+  Bit32u sector = sector_num, end = sector_num + (Bit32u)(count / sector_size), run;
+  bx_bool hole;
+  int n = 0;
+
+  materialize(sector, end - sector);
+  while (sector < end) {
+    run = classify_sectors(sector, end - sector, &hole);
+    if ((n > 0) && (extents[n - 1].hole == hole)) {
+      extents[n - 1].length += run * sector_size;
+    } else {
+      if (n == max)
+        break;
+      extents[n].length = run * sector_size;
+      extents[n].hole = hole;
+      n++;
+    }
+    sector += run;
+  }
+  return n;
+}
+
+// Readahead hint: file data in the next count bytes will be read soon, so
+// the host can start loading it. Clusters without a host file are skipped.
+int vvfat_image_t::prefetch(size_t count)
+{
+  Bit32u cluster_num, last_cluster, end, first_sector;
+  Bit32u sectors = (Bit32u)(count / sector_size);
+  mapping_t *mapping;
+  off_t offset;
+
+  if ((sectors == 0) || (sector_num + sectors <= offset_to_data))
+    return 0;
+  first_sector = (sector_num < offset_to_data) ? offset_to_data : sector_num;
+  cluster_num = sector2cluster(first_sector);
+  last_cluster = sector2cluster(sector_num + sectors - 1);
+  if (last_cluster >= cluster_count + 2)
+    last_cluster = cluster_count + 1;
+  while (cluster_num <= last_cluster) {
+    mapping = find_mapping_for_cluster(cluster_num);
+    if (mapping == NULL) {
+      cluster_num++;
+      continue;
+    }
+    end = (mapping->end <= last_cluster) ? mapping->end : last_cluster + 1;
+    if ((mapping->mode == MODE_NORMAL) && !open_file(mapping)) {
+      offset = cluster_size * (cluster_num - mapping->begin) + mapping->info.file.offset;
+      posix_fadvise(current_fd, offset, (off_t)cluster_size * (end - cluster_num),
+                    POSIX_FADV_WILLNEED);
+    }
+    cluster_num = end;
+  }
+  return 0;
+}
+
 ssize_t vvfat_image_t::write(const void* buf, size_t count)
 {
   ssize_t ret = 0;
   char *cbuf = (char*)buf;
-  Bit32u scount = (Bit32u)(count / 512);
+  Bit32u scount = (Bit32u)(count / sector_size);
   bx_bool update_imagepos;
 
+  materialize(sector_num, scount);
+  last_written = 0;
   while (scount-- > 0) {
     update_imagepos = 1;
     if (sector_num == 0) {
-      printf("VVFAT write mbr: sector=%d, count=%d\n", sector_num, scount);
+      buse_log(BUSE_LOG_DEBUG, "VVFAT write mbr: sector=%d, count=%d\n", sector_num, scount);
       // allow writing to MBR (except partition table)
       memcpy(&first_sectors[0], cbuf, 0x1b8);
     } else if (sector_num == offset_to_bootsector) {
-      printf("VVFAT write boot sector: sector=%d, count=%d\n", sector_num, scount);
+      buse_log(BUSE_LOG_DEBUG, "VVFAT write boot sector: sector=%d, count=%d\n", sector_num, scount);
       // allow writing to boot sector
-      memcpy(&first_sectors[sector_num * 0x200], cbuf, 0x200);
+      memcpy(&first_sectors[sector_num * sector_size], cbuf, sector_size);
     } else if ((fat_type == 32) && (sector_num == (offset_to_bootsector + 1))) {
-      printf("VVFAT write info sector: sector=%d, count=%d\n", sector_num, scount);
+      buse_log(BUSE_LOG_DEBUG, "VVFAT write info sector: sector=%d, count=%d\n", sector_num, scount);
       // allow writing to FS info sector
-      memcpy(&first_sectors[sector_num * 0x200], cbuf, 0x200);
+      memcpy(&first_sectors[sector_num * sector_size], cbuf, sector_size);
     } else if (sector_num < (offset_to_bootsector + reserved_sectors)) {
-      printf("VVFAT write ignored: sector=%d, count=%d\n", sector_num, scount);
+      buse_log(BUSE_LOG_DEBUG, "VVFAT write ignored: sector=%d, count=%d\n", sector_num, scount);
       //ret = -1;
+    } else if (write_through && (sector_num >= offset_to_data) &&
+               write_sector_through(cbuf)) {
+      buse_trace(TRACE_VVFAT_WRITE_THROUGH, sector_num, scount);
+      last_written |= WRITTEN_THROUGH;
     } else {
-      printf("VVFAT write: sector=%d, count=%d\n", sector_num, scount);
+      buse_trace(TRACE_VVFAT_WRITE, sector_num, scount);
+      last_written |= WRITTEN_REDOLOG;
       vvfat_modified = 1;
+      mark_sector_dirty(sector_num, cbuf);
       update_imagepos = 0;
-      ret = redolog->write(cbuf, 0x200);
+      ret = redolog->write(cbuf, sector_size);
     }
     if (ret < 0) break;
     sector_num++;
-    cbuf += 0x200;
+    cbuf += sector_size;
     if (update_imagepos) {
-      redolog->lseek(sector_num * 0x200, SEEK_SET);
+      redolog->lseek((Bit64s)sector_num * sector_size, SEEK_SET);
     }
   }
+  unsynced |= last_written;
   return (ret < 0) ? ret : count;
 }
 
+ssize_t vvfat_image_t::write_zeroes(size_t count)
+{
+  static const Bit8u zeroes[0x10000] = { 0 };
+  size_t done = 0, len;
+  Bit8u written = 0;
+  ssize_t ret;
+
+  while (done < count) {
+    len = (count - done < sizeof(zeroes)) ? count - done : sizeof(zeroes);
+    ret = write(zeroes, len);
+    written |= last_written;
+    if (ret < 0) {
+      last_written = written;
+      return ret;
+    }
+    done += len;
+  }
+  last_written = written;
+  return count;
+}
+
+// make all writes accepted so far durable in the redolog; committing them to
+// the shadowed directory is left to commit_changes()
+int vvfat_image_t::flush(void)
+{
+  return sync_writes(unsynced);
+}
+
+// make only the data of the last write() durable (FUA); other files written
+// through since the last flush are left alone
+int vvfat_image_t::flush_last_write(void)
+{
+  return sync_writes(last_written);
+}
+
+int vvfat_image_t::sync_writes(Bit8u targets)
+{
+  int ret = 0;
+
+  if (targets & WRITTEN_REDOLOG) {
+    if (redolog->sync() < 0) {
+      printf("VVFAT flush: fdatasync() failed: %s\n", strerror(errno));
+      ret = -1;
+    } else {
+      unsynced &= ~WRITTEN_REDOLOG;
+    }
+  }
+  if ((targets & WRITTEN_THROUGH) && (write_through_fd >= 0)) {
+    if (fdatasync(write_through_fd) < 0) {
+      char path[BX_PATHNAME_LEN];
+      mapping_path(write_through_mapping, path);
+      printf("VVFAT flush: fdatasync() of %s failed: %s\n", path, strerror(errno));
+      ret = -1;
+    } else {
+      unsynced &= ~WRITTEN_THROUGH;
+    }
+  }
+  return ret;
+}
+
+// Data sectors inside the original size of a file whose cluster chain the
+// guest did not touch are written straight into the host file. Once the chain
+// may have changed the file stays in the redolog, so a sector written through
+// is never shadowed by an older redolog copy.
+bx_bool vvfat_image_t::write_through_possible(mapping_t *mapping)
+{
+  return write_through && !(mapping->mode & MODE_DIRECTORY) &&
+         !mapping->read_only && !mapping->fat_dirty;
+}
+
+void vvfat_image_t::close_write_through(void)
+{
+  if (write_through_fd >= 0) {
+    // a later flush only knows about the file open then
+    if ((unsynced | last_written) & WRITTEN_THROUGH)
+      fdatasync(write_through_fd);
+    unsynced &= ~WRITTEN_THROUGH;
+    last_written &= ~WRITTEN_THROUGH;
+    ::close(write_through_fd);
+    write_through_fd = -1;
+    write_through_mapping = NULL;
+  }
+}
+
+bx_bool vvfat_image_t::write_sector_through(const void *buf)
+{
+  Bit32u cluster_num = sector2cluster(sector_num);
+  mapping_t *mapping;
+  direntry_t *entry;
+  off_t offset;
+  char path[BX_PATHNAME_LEN];
+
+  if (cluster_num >= cluster_count + 2)
+    return 0;
+  mapping = find_mapping_for_cluster(cluster_num);
+  if ((mapping == NULL) || (mapping->mode != MODE_NORMAL) ||
+      !write_through_possible(mapping))
+    return 0;
+  entry = (direntry_t*)array_get(&directory, mapping->dir_index);
+  offset = cluster_size * (cluster_num - mapping->begin) + mapping->info.file.offset
+           + ((sector_num - offset_to_data) % sectors_per_cluster) * sector_size;
+  if (offset + sector_size > (off_t)dtoh32(entry->size))
+    return 0;
+
+  if (write_through_mapping != mapping) {
+    close_write_through();
+    mapping_path(mapping, path);
+    write_through_fd = ::open(path, O_WRONLY
+#ifdef O_BINARY
+                              | O_BINARY
+#endif
+#ifdef O_LARGEFILE
+                              | O_LARGEFILE
+#endif
+                              );
+    if (write_through_fd < 0)
+      return 0;
+    write_through_mapping = mapping;
+  }
+  if (::pwrite(write_through_fd, buf, sector_size, offset) != sector_size)
+    return 0;
+  mapping->written_through = 1;
+  if (current_cluster == cluster_num)
+    current_cluster = 0xffff;
+  return 1;
+}
+
 Bit32u vvfat_image_t::get_capabilities(void)
 {
   return HDIMAGE_HAS_GEOMETRY;
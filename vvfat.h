@@ -82,6 +82,30 @@ typedef int64_t Bit64s;
 typedef bool bx_bool;
 
 Bit16u fat_datetime(time_t time, int return_time);
+// the FAT dates and times of count timestamps, as fat_datetime() would give
+void fat_datetimes(const time_t *stamps, int count, Bit16u *dates, Bit16u *times);
+
+// strings that live as long as the mappings, freed all at once by close()
+typedef struct name_arena_t {
+  char *block; // current block, it starts with a pointer to the previous one
+  Bit32u used, size;
+} name_arena_t;
+
+// the short names of the directory being read, for finding duplicates
+// without rescanning it; slots of an older generation are free
+typedef struct shortname_slot_t {
+  Bit32u generation;
+  Bit8u name[11];
+  bx_bool taken;    // an entry of the directory has this name
+  bx_bool mangled;  // last holds the last name this one was mangled into
+  Bit8u last[11];
+} shortname_slot_t;
+
+typedef struct shortname_table_t {
+  shortname_slot_t *slots;
+  Bit32u size, count, generation;
+  int directory_start; // first entry of the directory, -1 if none yet
+} shortname_table_t;
 
 typedef struct array_t {
   char *pointer;
@@ -116,7 +140,19 @@ direntry_t;
 enum {
   MODE_UNDEFINED = 0, MODE_NORMAL = 1, MODE_MODIFIED = 2,
   MODE_DIRECTORY = 4, MODE_FAKED = 8,
-  MODE_DELETED = 16, MODE_RENAMED = 32
+  MODE_DELETED = 16, MODE_RENAMED = 32,
+  MODE_LAZY = 64  // a directory whose subtree isn't laid out yet
+};
+
+// a run of sectors as get_extents() reports it
+typedef struct {
+  Bit32u  length;  // in bytes
+  bx_bool hole;    // reads as zeros, nothing backs it
+} vvfat_extent_t;
+
+// where write() put the data, for flushing only what was written
+enum {
+  WRITTEN_REDOLOG = 1, WRITTEN_THROUGH = 2
 };
 
 typedef struct mapping_t {
@@ -140,14 +176,72 @@ typedef struct mapping_t {
       int first_dir_index;
     } dir;
   } info;
-  // path contains the full path, i.e. it always starts with vvfat_path
-  char *path;
+  // name of the file in the directory of the parent mapping, or the full
+  // path if parent is -1 (the root); see mapping_path()
+  const char *name;
+  int parent;
 
   Bit8u mode;
 
   int read_only;
+  // the guest wrote sectors of it straight into the host file
+  bx_bool written_through;
+  // the guest wrote a FAT entry of its clusters, the chain may have changed
+  bx_bool fat_dirty;
 } mapping_t;
 
+// a subtree init_directories() left for later, see populate_lazy_dir()
+typedef struct lazy_dir_t {
+  int mapping_index;
+  // the clusters reserved for it
+  Bit32u begin, end;
+  // clusters it took last time (0 if unknown), and this time once populated
+  Bit32u estimate, used;
+  bx_bool pending;
+} lazy_dir_t;
+
+// the guest side state of a host directory, as of the last commit
+
+enum {
+  DIRSTATE_MODIFIED = 1, DIRSTATE_SUBTREE = 2, DIRSTATE_NEW = 4,
+  DIRSTATE_MOVED = 8, DIRSTATE_REMOVED = 16, DIRSTATE_GONE = 32
+};
+
+typedef struct diritem_t {
+  direntry_t entry;
+  char *name;
+  // matching entry in the other list and its directory (-1: same directory)
+  int peer, peer_dir;
+} diritem_t;
+
+typedef struct dirstate_t {
+  // first cluster (0 for the FAT12/16 root directory)
+  Bit32u begin;
+  int parent;
+  // full path for the root directory, the file name otherwise
+  char *name;
+  // directory clusters saved by the last commit; NULL if still the same as
+  // the entries built by init_directories() for mapping_index
+  Bit8u *entries;
+  Bit32u size;
+  int mapping_index;
+  Bit8u flags;
+  // valid during commit on modified directories only
+  Bit8u *new_entries;
+  Bit32u new_size;
+  diritem_t *old_items, *new_items;
+  int old_count, new_count;
+} dirstate_t;
+
+// FAT entry accessors for one FAT width, picked by init_fat()
+typedef struct fat_ops_t {
+  Bit32u (*get)(const void *table, Bit32u cluster);
+  void (*set)(void *table, Bit32u cluster, Bit32u value);
+  // links the clusters [begin, end) in ascending order and ends the chain
+  void (*chain)(void *table, Bit32u begin, Bit32u end);
+  Bit32u max_value;
+} fat_ops_t;
+
 #define STANDARD_HEADER_MAGIC     "Bochs Virtual HD Image"
 #define STANDARD_HEADER_V1        (0x00010000)
 #define STANDARD_HEADER_VERSION   (0x00020000)
@@ -217,6 +311,11 @@ class redolog_t
       Bit64s lseek(Bit64s offset, int whence);
       ssize_t read(void* buf, size_t count);
       ssize_t write(const void* buf, size_t count);
+      int sync();
+      bx_bool contains(Bit64s offset, Bit64s count);
+      // bytes per block, 512 unless set before create(); open() takes it
+      // from the header
+      void set_block_size(Bit32u size) { block_size = size; }
 
       static int check_format(int fd, const char *subtype);
 
@@ -228,17 +327,20 @@ class redolog_t
 
   private:
       void             print_header();
+      Bit8u*           extent_bitmap(Bit32u extent);
       int              fd;
       redolog_header_t header;     // Header is kept in x86 (little) endianness
       Bit32u          *catalog;
-      Bit8u           *bitmap;
-      bx_bool          bitmap_update;
+      // the bitmaps of the allocated extents, as on disk, by extent number
+      Bit8u           *bitmaps;
+      Bit32u           bitmaps_size;  // extents there is room for
       Bit32u           extent_index;
       Bit32u           extent_offset;
       Bit32u           extent_next;
 
       Bit32u           bitmap_blocks;
       Bit32u           extent_blocks;
+      Bit32u           block_size;
 
       Bit64s           imagepos;
 };
@@ -255,7 +357,21 @@ class vvfat_image_t// : public device_image_t
     Bit64s lseek(Bit64s offset, int whence);
     ssize_t read(void* buf, size_t count);
     ssize_t write(const void* buf, size_t count);
+    ssize_t write_zeroes(size_t count);
+    int map_read(size_t count, off_t *offset);
+    int prefetch(size_t count);
+    int get_extents(size_t count, vvfat_extent_t *extents, int max);
     Bit32u get_capabilities();
+    int flush(void);
+    int flush_last_write(void);
+    void set_write_through(bx_bool enable) { write_through = enable; }
+    // logical sector size, 512 or 4096; set before open()
+    void set_sector_size(Bit32u size) { sector_size = size; }
+    Bit32u get_sector_size(void) { return sector_size; }
+    // directories this many levels below the root are read when the guest
+    // first looks at them, 0 reads everything at open(); set before open()
+    void set_lazy_depth(int depth) { lazy_depth = depth; }
+    bx_bool is_modified(void) { return vvfat_modified; }
     void commit_changes(void);
 
   private:
@@ -268,19 +384,57 @@ class vvfat_image_t// : public device_image_t
       const char* filename, int is_dot);
     int read_directory(int mapping_index);
     Bit32u sector2cluster(off_t sector_num);
+    const Bit8u *meta_sector(Bit32u sector);
+    Bit32u classify_sectors(Bit32u sector, Bit32u limit, bx_bool *hole);
     off_t cluster2sector(Bit32u cluster_num);
     int init_directories(const char* dirname);
+    int mapping_depth(const mapping_t *mapping);
+    int lay_out_mapping(unsigned index, Bit32u *cluster, Bit32u limit, bx_bool defer);
+    void drop_mappings(unsigned first);
+    int reserve_lazy_dirs(Bit32u *cluster);
+    void populate_lazy_dir(unsigned index);
+    void materialize_clusters(Bit32u first, Bit32u end);
+    void materialize(Bit32u sector, Bit32u count);
+    void save_lazy_estimates(void);
     bx_bool read_sector_from_file(const char *path, Bit8u *buffer, Bit32u sector);
-    void set_file_attributes(void);
+    void set_file_attributes(unsigned first);
     Bit32u fat_get_next(Bit32u current);
+    void mark_sector_dirty(Bit32u sector, const void *buf);
+    void update_fat_sector(Bit32u index, const Bit8u *buf);
+    bx_bool write_through_possible(mapping_t *mapping);
+    int sync_writes(Bit8u targets);
+    void close_write_through(void);
+    bx_bool write_sector_through(const void *buf);
+    void save_attributes(const char *path, direntry_t *entry);
+    bx_bool chain_in_place(const char *path, Bit32u fstart);
+    void retire_mapping(const char *path);
     bx_bool write_file(const char *path, direntry_t *entry, bx_bool create);
+    void set_file_times(const char *path, direntry_t *entry);
     direntry_t* read_direntry(Bit8u *buffer, char *filename);
-    void parse_directory(const char *path, Bit32u start_cluster);
+    void init_dirstates(unsigned first);
+    void sort_dirstates(void);
+    int find_dirstate(Bit32u begin);
+    bx_bool dirstate_path(int index, char *path);
+    Bit8u* read_dir_clusters(Bit32u start_cluster, Bit32u *size);
+    int parse_dir_entries(Bit8u *buffer, Bit32u size, diritem_t **items);
+    int dirstate_entries(dirstate_t *state, diritem_t **items);
+    bx_bool dirstate_dirty(dirstate_t *state);
+    void diff_directory(int index);
+    void match_moves(void);
+    void rename_mapping_paths(const char *oldpath, const char *newpath);
+    void rename_path(const char *oldpath, const char *newpath);
+    void update_file(const char *path, direntry_t *entry, direntry_t *old);
+    void remove_file(const char *path, const direntry_t *entry);
+    void sync_directory(int index);
+    void remove_directory(int index);
+    void save_dirstate_attributes(void);
     void close_current_file(void);
     int open_file(mapping_t* mapping);
-    int find_mapping_for_cluster_aux(int cluster_num, int index1, int index2);
+    void index_mappings(void);
     mapping_t* find_mapping_for_cluster(int cluster_num);
     mapping_t* find_mapping_for_path(const char* path);
+    void mapping_path(const mapping_t *mapping, char *path);
+    bx_bool mapping_has_path(const mapping_t *mapping, const char *path, size_t len);
     int read_cluster(int cluster_num);
 
     Bit8u  *first_sectors;
@@ -293,6 +447,7 @@ class vvfat_image_t// : public device_image_t
     Bit8u  sectors_per_cluster;
     Bit32u sectors_per_fat;
     Bit32u sector_count;
+    Bit32u sector_size;
     Bit32u cluster_count; // total number of clusters of this partition
     Bit32u max_fat_value;
     Bit32u first_cluster_of_root_dir;
@@ -300,7 +455,23 @@ class vvfat_image_t// : public device_image_t
     Bit16u reserved_sectors;
 
     Bit8u  fat_type;
+    fat_ops_t fat_ops;
     array_t fat, directory, mapping;
+    name_arena_t names;  // mapping names
+    shortname_table_t shortnames;
+    Bit8u *dirent_buffer;  // for getdents64() in read_directory()
+    array_t dirscan;       // ... and the entries of that buffer it stat()s
+    struct stat_ring_t *stat_ring;
+    // the begin cluster of every mapping in cluster order, and of every
+    // MAPPING_INDEX_STRIDE'th one; find_mapping_for_cluster() searches these
+    // instead of the mappings. mapping_order holds the mapping indices.
+    Bit32u *mapping_begin;
+    Bit32u *mapping_order;
+    Bit32u *mapping_begin_top;
+    unsigned mapping_top_count;
+    int lazy_depth;
+    array_t lazy_dirs;      // sorted by cluster
+    unsigned lazy_pending;  // lazy_dirs not populated yet
 
     int current_fd;
     mapping_t* current_mapping;
@@ -316,7 +487,22 @@ class vvfat_image_t// : public device_image_t
     FILE    *vvfat_attr_fd;
 
     bx_bool   vvfat_modified;
-    void      *fat2;
+    // one bit per FAT entry the guest changed since the image was opened and
+    // per cluster written or FAT entry changed since the last commit (cluster
+    // bit 0 stands for the FAT12/16 root directory); commit only reads the
+    // directories flagged here
+    Bit8u     *dirty_fat;
+    Bit8u     *dirty_clusters;
+    array_t   dirstates;
+    int       *dirstate_order; // dirstates sorted by first cluster
+    unsigned  dirstate_sorted;
+    bx_bool   attributes_changed;
+    bx_bool   write_through;  // write file data to the host file directly
+    int       write_through_fd;
+    mapping_t *write_through_mapping;
+    Bit8u     unsynced;       // WRITTEN_* not made durable yet
+    Bit8u     last_written;   // WRITTEN_* of the last write()
+    void      *fat2;          // shadow of the FAT as written by the guest
     redolog_t *redolog;       // Redolog instance
     char      *redolog_name;  // Redolog name
     char      *redolog_temp;  // Redolog temporary file name